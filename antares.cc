@@ -21,7 +21,7 @@
 // FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
 // OTHER DEALINGS IN THE SOFTWARE.
 
-// The main module for Havannah playing via GTP.
+// The GTP frontend for one board size.
 
 #include <assert.h>
 #include <ctype.h>
@@ -29,23 +29,19 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <time.h>
 #include <unistd.h>
+#include <sys/time.h>
+#include <algorithm>
 #include <string>
 #include <utility>
 #include <vector>
 
-//#define USE_READLINE
-
-#ifdef USE_READLINE
-#include "readline/history.h"
-#include "readline/readline.h"
-#endif  // USE_READLINE
-
 #include "engine.h"
+#include "frontend.h"
 #include "havannah.h"
 
 namespace lajkonik {
+namespace SIZED_NAMESPACE {
 
 namespace {
 
@@ -72,15 +68,15 @@ bool GetColor(const char* s, Player* color) {
 }  // namespace
 
 // A parser for the subset of GTP v2 applicable to Havannah.
-class Frontend {
+class Frontend : public FrontendBase {
  public:
   static Frontend* Create(Engine* engine);
   static Frontend* get() {
     assert(frontend_instance_ != NULL);
     return frontend_instance_;
   }
-  void HandleCommand(char* command);
-  static char* CommandGenerator(const char* text, int state);
+  virtual void HandleCommand(char* command);
+  virtual char* GenerateCommand(const char* text, int state);
 
  private:
   static const char kSuccess = '=';
@@ -92,7 +88,6 @@ class Frontend {
   };
 
   explicit Frontend(Engine* engine);
-  ~Frontend();
 
   void StartAnswer(char indicator);
   void Answer(char indicator, const char* format, ...);
@@ -108,6 +103,7 @@ class Frontend {
   void ClearBoard(const std::vector<char*>& args);
   void Genmove(const std::vector<char*>& args);
   void Evaluate(const std::vector<char*>& args);
+  void EvaluateBatch(const std::vector<char*>& args);
   void HavannahWinner(const std::vector<char*>& args);
   void KnownCommand(const std::vector<char*>& args);
   void Komi(const std::vector<char*>& args);
@@ -129,10 +125,6 @@ class Frontend {
   //
   static const Command kCommands[];
   //
-  std::vector<std::pair<const char*, double*> > double_options_;
-  std::vector<std::pair<const char*, int*> > int_options_;
-  std::vector<std::pair<const char*, bool*> > bool_options_;
-  //
   Engine* engine_;
   //
   int result_;
@@ -144,6 +136,9 @@ class Frontend {
   Player player_;
   //
   volatile bool is_thinking_;
+  // The command line before lowercasing, for case-sensitive arguments.
+  std::string raw_input_;
+  const char* input_;
 
   Frontend(const Frontend&);
   void operator=(const Frontend&);
@@ -153,6 +148,7 @@ const Frontend::Command Frontend::kCommands[] = {
   { "boardsize", &Frontend::Boardsize },
   { "clearboard", &Frontend::ClearBoard },
   { "eval", &Frontend::Evaluate },
+  { "evalbatch", &Frontend::EvaluateBatch },
   { "genmove", &Frontend::Genmove },
   { "havannahwinner", &Frontend::HavannahWinner },
   { "knowncommand", &Frontend::KnownCommand },
@@ -303,7 +299,9 @@ void Frontend::Boardsize(const std::vector<char*>& args) {
   int size;
   if (args.size() != 1)
     Answer(kFailure, "expected one argument to boardsize");
-  else if (StrToInt(args[0], &size) && size == SIDE_LENGTH)
+  else if (!StrToInt(args[0], &size))
+    return;
+  else if (size == SIDE_LENGTH || SwitchFrontend(size))
     Answer(kSuccess, "");
   else
     Answer(kFailure, "unacceptable size %s", args[0]);
@@ -347,6 +345,40 @@ void Frontend::Evaluate(const std::vector<char*>& args) {
       player, cell1, cell2).c_str());
 }
 
+void Frontend::EvaluateBatch(const std::vector<char*>& args) {
+  if (args.empty() || args.size() > 2) {
+    Answer(kFailure, "expected one or two arguments to evalbatch");
+    return;
+  }
+  int num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+  if (args.size() == 2 && !StrToInt(args[1], &num_threads))
+    return;
+  if (num_threads < 1) {
+    Answer(kFailure, "invalid number of threads %d", num_threads);
+    return;
+  }
+  const std::string file_name =
+      raw_input_.substr(args[0] - input_, strlen(args[0]));
+  std::vector<std::string> positions;
+  if (!ReadBatch(file_name.c_str(), &positions)) {
+    Answer(kFailure, "cannot read %s", file_name.c_str());
+    return;
+  }
+  timeval start_time;
+  gettimeofday(&start_time, NULL);
+  StartAnswer(kSuccess);
+  printf("\n");
+  fflush(stdout);
+  const int num_valid = lajkonik::EvaluateBatch(positions, num_threads, stdout);
+  printf("\n");
+  timeval end_time;
+  gettimeofday(&end_time, NULL);
+  const double seconds = (end_time.tv_sec - start_time.tv_sec) +
+      1e-6 * (end_time.tv_usec - start_time.tv_usec);
+  fprintf(stderr, "%d positions in %.3f s, %.1f positions/s\n",
+          num_valid, seconds, num_valid / std::max(seconds, 1e-6));
+}
+
 void Frontend::Genmove(const std::vector<char*>& args) {
   Player player = player_;
   int thinking_time_index = 0;
@@ -559,6 +591,8 @@ void Frontend::Version(const std::vector<char*>& /*args*/) {
 }
 
 void Frontend::HandleCommand(char* input) {
+  raw_input_ = input;
+  input_ = input;
   for (char* p = input; *p != '\0'; ++p) {
     *p = tolower(*p);
   }
@@ -588,7 +622,7 @@ void Frontend::HandleCommand(char* input) {
   Answer(kFailure, "unknown command %s", command);
 }
 
-char* Frontend::CommandGenerator(const char* text, int state) {
+char* Frontend::GenerateCommand(const char* text, int state) {
   static int list_index;
   static int len;
   const char* name;
@@ -604,46 +638,17 @@ char* Frontend::CommandGenerator(const char* text, int state) {
   return NULL;
 }
 
-}  // namespace lajkonik
-
 namespace {
 
-#ifdef USE_READLINE
-char** AntaresCompletion(const char* text, int start, int /*end*/) {
-  rl_attempted_completion_over = 1;
-  if (start == 0)
-    return rl_completion_matches(text, lajkonik::Frontend::CommandGenerator);
-  else
-    return NULL;
+FrontendBase* CreateFrontend() {
+  return Frontend::Create(new Engine);
 }
-#endif  // USE_READLINE
 
-char* GetLine() {
-  static char buffer[1024];
-#ifdef USE_READLINE
-  if (isatty(fileno(stdout)))
-    return readline(NULL);
-  else
-#endif  // USE_READLINE
-    return fgets(buffer, sizeof buffer, stdin);
-}
+struct RegisterModule {
+  RegisterModule() { RegisterFrontend(SIDE_LENGTH, CreateFrontend); }
+} register_module;
 
 }  // namespace
 
-int main() {
-  srand(time(NULL));
-  lajkonik::Engine engine;
-  lajkonik::Frontend* frontend = lajkonik::Frontend::Create(&engine);
-#ifdef USE_READLINE
-  rl_attempted_completion_function = AntaresCompletion;
-#endif  // USE_READLINE
-  char* command;
-  while ((command = GetLine()) != NULL) {
-#ifdef USE_READLINE
-    if (command[0] != '\0')
-      add_history(command);
-#endif  // USE_RADLINE
-    frontend->HandleCommand(command);
-  }
-  return 0;
-}
+}  // namespace SIZED_NAMESPACE
+}  // namespace lajkonik
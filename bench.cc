@@ -0,0 +1,493 @@
+// Copyright (c) 2010-2012 Marcin Ciura, Piotr Wieczorek
+//
+// Permission is hereby granted, free of charge, to any person
+// obtaining a copy of this software and associated documentation
+// files (the "Software"), to deal in the Software without
+// restriction, including without limitation the rights to use,
+// copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following
+// conditions:
+//
+// The above copyright notice and this permission notice shall be
+// included in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+// EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+// OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+// NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+// HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+// WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+// OTHER DEALINGS IN THE SOFTWARE.
+
+// Micro-benchmarks for havannah.cc. Run as "bench <name>" or as "bench"
+// for all of them.
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include <vector>
+
+#include "havannah.h"
+#include "rng.h"
+
+namespace lajkonik {
+namespace {
+
+// The number of permanent moves made before each benchmark.
+const int kOpeningMoves = 20;
+
+double Now() {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + 1e-6 * tv.tv_usec;
+}
+
+// Initializes position to a start position followed by random moves.
+void MakeOpening(Rng* rng, Position* position) {
+  position->InitToStartPosition();
+  for (int i = 0; i < kOpeningMoves; ++i) {
+    Cell cell;
+    do {
+      cell = position->NthAvailableCell((*rng)(position->NumAvailableMoves()));
+    } while (!position->CellIsEmpty(cell));
+    position->MakePermanentMove(static_cast<Player>(i & 1), cell);
+  }
+}
+
+// Makes up to depth random moves into position and returns their number,
+// which is smaller if some move wins. Like the moves of the search,
+// the moves touch stones of the player, if possible, and merge chains.
+int MakeRandomLine(Rng* rng, int depth, Position* position, Memento* memento) {
+  std::vector<Cell> cells;
+  for (int n = 0; n < position->NumAvailableMoves(); ++n) {
+    const Cell cell = position->NthAvailableCell(n);
+    if (position->CellIsEmpty(cell))
+      cells.push_back(cell);
+  }
+  rng->Shuffle(cells.begin(), cells.end());
+  const Player first = static_cast<Player>(position->MoveCount() & 1);
+  for (int i = 0; i < depth && !cells.empty(); ++i) {
+    const Player player = (i & 1) ? Opponent(first) : first;
+    size_t j = 0;
+    while (j < cells.size() - 1 &&
+           position->Get6Neighbors(player, cells[j]) == 0) {
+      ++j;
+    }
+    const Cell cell = cells[j];
+    cells.erase(cells.begin() + j);
+    if (position->MakeMoveReversibly(player, cell, memento) !=
+        kNoWinningCondition) {
+      return i + 1;
+    }
+  }
+  return depth;
+}
+
+// Measures how long it takes to find the newest chain of a stone after
+// a line of reversible moves of the given length, as the search does.
+void BenchmarkChainLookup() {
+  static const int kDepths[] = { 0, 8, 16, 24, 32, 48, 64 };
+  const int kLines = 200;
+  const int kRepeats = 200;
+  printf("chains: depth, ns per NewestChainForCell()\n");
+  for (int d = 0; d < ARRAYSIZE(kDepths); ++d) {
+    Rng rng;
+    rng.Init(12345);
+    Position position;
+    MakeOpening(&rng, &position);
+    double seconds = 0.0;
+    long long lookups = 0;
+    unsigned checksum = 0;
+    for (int line = 0; line < kLines; ++line) {
+      Memento memento;
+      MakeRandomLine(&rng, kDepths[d], &position, &memento);
+      std::vector<std::pair<Player, Cell> > stones;
+      for (Cell cell = kZerothCell; cell < kNumCellsWithSentinels;
+           cell = NextCell(cell)) {
+        for (int p = 0; p < 2; ++p) {
+          const Player player = static_cast<Player>(p);
+          if (position.player_position(player).StoneIsInCell(cell))
+            stones.push_back(std::make_pair(player, cell));
+        }
+      }
+      const double start = Now();
+      for (int r = 0; r < kRepeats; ++r) {
+        for (size_t i = 0; i < stones.size(); ++i) {
+          checksum += position.player_position(stones[i].first)
+              .NewestChainForCell(stones[i].second);
+        }
+      }
+      seconds += Now() - start;
+      lookups += kRepeats * stones.size();
+      memento.UndoAll();
+    }
+    printf("%6d %8.2f   (%u)\n",
+           kDepths[d], 1e9 * seconds / lookups, checksum & 0xff);
+  }
+}
+
+long long Perft(Player player, int width, int depth, UndoLog* log,
+               Position* position);
+
+// Makes and undoes with the memento up to width moves of the player,
+// counting the leaves of the tree of the given depth below the position.
+long long PerftWithMemento(Player player, int width, int depth, UndoLog* log,
+                           Memento* memento, Position* position) {
+  long long leaves = 0;
+  int num_moves = 0;
+  for (int n = 0; n < position->NumAvailableMoves() && num_moves < width;
+       ++n) {
+    const Cell cell = position->NthAvailableCell(n);
+    if (!position->CellIsEmpty(cell))
+      continue;
+    ++num_moves;
+    if (position->MakeMoveReversibly(player, cell, memento) !=
+        kNoWinningCondition || depth == 1) {
+      ++leaves;
+    } else {
+      leaves += Perft(Opponent(player), width, depth - 1, log, position);
+    }
+    memento->UndoAll();
+  }
+  return leaves;
+}
+
+// Counts the leaves like PerftWithMemento(), with a Memento per node
+// that has its own log if log is NULL and appends to log otherwise.
+long long Perft(Player player, int width, int depth, UndoLog* log,
+                Position* position) {
+  if (log == NULL) {
+    Memento memento;
+    return PerftWithMemento(player, width, depth, log, &memento, position);
+  }
+  Memento memento(log);
+  return PerftWithMemento(player, width, depth, log, &memento, position);
+}
+
+// Measures how long it takes to make and undo a move in full-width
+// trees and in narrow trees like those of the search, with a Memento
+// per node that has its own log and with a shared UndoLog.
+void BenchmarkPerft() {
+  static const struct {
+    int width;
+    int depth;
+  } kTrees[] = {
+    { kNumMovesOnBoard, 1 }, { kNumMovesOnBoard, 2 },
+    { 16, 3 }, { 8, 5 }, { 4, 8 },
+  };
+  const int kOpenings = 4;
+  printf("perft: width, depth, leaves, "
+         "ns per leaf with own logs, with a shared log\n");
+  for (int t = 0; t < ARRAYSIZE(kTrees); ++t) {
+    double seconds[2] = { 0.0, 0.0 };
+    long long leaves[2] = { 0, 0 };
+    for (int i = 0; i < 2; ++i) {
+      Rng rng;
+      rng.Init(12345);
+      UndoLog undo_log;
+      for (int opening = 0; opening < kOpenings; ++opening) {
+        Position position;
+        MakeOpening(&rng, &position);
+        const double start = Now();
+        leaves[i] += Perft(static_cast<Player>(kOpeningMoves & 1),
+                           kTrees[t].width, kTrees[t].depth,
+                           (i == 0) ? NULL : &undo_log, &position);
+        seconds[i] += Now() - start;
+      }
+    }
+    assert(leaves[0] == leaves[1]);
+    printf("%6d %6d %10lld %8.1f %8.1f\n",
+           kTrees[t].width, kTrees[t].depth, leaves[0],
+           1e9 * seconds[0] / leaves[0], 1e9 * seconds[1] / leaves[1]);
+  }
+}
+
+// Counts the moves made in a tree like the one of Perft(), making them
+// in position and undoing them with Mementoes that share log.
+long long CountNodes(Player player, int width, int depth, UndoLog* log,
+                     Position* position) {
+  Memento memento(log);
+  long long nodes = 0;
+  int num_moves = 0;
+  for (int n = 0; n < position->NumAvailableMoves() && num_moves < width;
+       ++n) {
+    const Cell cell = position->NthAvailableCell(n);
+    if (!position->CellIsEmpty(cell))
+      continue;
+    ++num_moves;
+    ++nodes;
+    if (position->MakeMoveReversibly(player, cell, &memento) ==
+        kNoWinningCondition && depth > 1) {
+      nodes += CountNodes(Opponent(player), width, depth - 1, log, position);
+    }
+    memento.UndoAll();
+  }
+  return nodes;
+}
+
+// Counts the same moves as CountNodes(), taking them in the order
+// of root and making them in copies of stack[0] put in stack[1].
+long long CountCompactNodes(Player player, int width, int depth,
+                            const Position& root, CompactPosition* stack) {
+  long long nodes = 0;
+  int num_moves = 0;
+  for (int n = 0; n < root.NumAvailableMoves() && num_moves < width; ++n) {
+    const Cell cell = root.NthAvailableCell(n);
+    if (!stack[0].CellIsEmpty(cell))
+      continue;
+    ++num_moves;
+    ++nodes;
+    stack[1].CopyFrom(stack[0]);
+    if (stack[1].MakeMove(player, cell) == kNoWinningCondition && depth > 1) {
+      nodes += CountCompactNodes(
+          Opponent(player), width, depth - 1, root, stack + 1);
+    }
+  }
+  return nodes;
+}
+
+// Measures how many nodes per second the search could visit making
+// its moves in a Position with Mementoes and in a stack of copied
+// CompactPositions.
+void BenchmarkNodesPerSecond() {
+  static const struct {
+    int width;
+    int depth;
+  } kTrees[] = {
+    { kNumMovesOnBoard, 2 }, { 16, 3 }, { 8, 5 }, { 4, 8 },
+  };
+  const int kMaxDepth = 8;
+  const int kOpenings = 4;
+  printf("nps: width, depth, nodes, "
+         "thousands of nodes per second with Position, CompactPosition\n");
+  for (int t = 0; t < ARRAYSIZE(kTrees); ++t) {
+    assert(kTrees[t].depth <= kMaxDepth);
+    double seconds[2] = { 0.0, 0.0 };
+    long long nodes[2] = { 0, 0 };
+    Rng rng;
+    rng.Init(12345);
+    UndoLog undo_log;
+    CompactPosition stack[kMaxDepth + 1];
+    for (int opening = 0; opening < kOpenings; ++opening) {
+      Position position;
+      MakeOpening(&rng, &position);
+      const Player player = static_cast<Player>(kOpeningMoves & 1);
+      double start = Now();
+      nodes[0] += CountNodes(
+          player, kTrees[t].width, kTrees[t].depth, &undo_log, &position);
+      seconds[0] += Now() - start;
+      start = Now();
+      stack[0].InitFromPosition(position);
+      nodes[1] += CountCompactNodes(
+          player, kTrees[t].width, kTrees[t].depth, position, stack);
+      seconds[1] += Now() - start;
+    }
+    assert(nodes[0] == nodes[1]);
+    printf("%6d %6d %10lld %8.0f %8.0f\n",
+           kTrees[t].width, kTrees[t].depth, nodes[0],
+           1e-3 * nodes[0] / seconds[0], 1e-3 * nodes[1] / seconds[1]);
+  }
+}
+
+// Measures how long it takes to clone a Position after a number
+// of permanent moves, as the search does before it starts.
+void BenchmarkCopy() {
+  static const int kMoveCounts[] = { 0, 20, 40, 80, 120 };
+  const int kRepeats = 2000;
+  printf("copy: moves, us per Position::CopyFrom()\n");
+  for (int m = 0; m < ARRAYSIZE(kMoveCounts); ++m) {
+    Rng rng;
+    rng.Init(12345);
+    Position position;
+    position.InitToStartPosition();
+    for (int i = 0; i < kMoveCounts[m]; ++i) {
+      Cell cell;
+      do {
+        cell = position.NthAvailableCell(rng(position.NumAvailableMoves()));
+      } while (!position.CellIsEmpty(cell));
+      if (position.MakePermanentMove(static_cast<Player>(i & 1), cell) !=
+          kNoWinningCondition) {
+        break;
+      }
+    }
+    Position copy;
+    const double start = Now();
+    for (int r = 0; r < kRepeats; ++r) {
+      copy.CopyFrom(position);
+    }
+    const double seconds = Now() - start;
+    printf("%6d %8.2f\n", position.MoveCount(), 1e6 * seconds / kRepeats);
+  }
+}
+
+// Makes up to depth moves into position, each of which joins two or more
+// groups of stones of the player who makes it, and appends them to moves.
+// Stops early if no such move exists or if a move wins.
+void MakeMergingLine(Rng* rng, int depth, Position* position,
+                     Memento* memento,
+                     std::vector<std::pair<Player, Cell> >* moves) {
+  std::vector<Cell> cells;
+  for (int n = 0; n < position->NumAvailableMoves(); ++n) {
+    const Cell cell = position->NthAvailableCell(n);
+    if (position->CellIsEmpty(cell))
+      cells.push_back(cell);
+  }
+  rng->Shuffle(cells.begin(), cells.end());
+  const Player first = static_cast<Player>(position->MoveCount() & 1);
+  for (int i = 0; i < depth; ++i) {
+    const Player player = (i & 1) ? Opponent(first) : first;
+    size_t j = 0;
+    while (j < cells.size() &&
+           Position::CountNeighborGroups(
+               position->Get6Neighbors(player, cells[j])) < 2) {
+      ++j;
+    }
+    if (j == cells.size())
+      return;
+    const Cell cell = cells[j];
+    cells.erase(cells.begin() + j);
+    moves->push_back(std::make_pair(player, cell));
+    if (position->MakeMoveReversibly(player, cell, memento) !=
+        kNoWinningCondition) {
+      return;
+    }
+  }
+}
+
+// Measures how long it takes to make and undo lines of moves that
+// merge chains, as in the midgame, after a number of permanent moves.
+void BenchmarkMerges() {
+  static const int kMoveCounts[] = { 20, 40, 60, 80 };
+  const int kDepth = 8;
+  const int kLines = 200;
+  const int kRepeats = 100;
+  printf("merges: moves, merging moves, ns per merging move\n");
+  for (int m = 0; m < ARRAYSIZE(kMoveCounts); ++m) {
+    Rng rng;
+    rng.Init(12345);
+    Position position;
+    position.InitToStartPosition();
+    for (int i = 0; i < kMoveCounts[m]; ++i) {
+      Cell cell;
+      do {
+        cell = position.NthAvailableCell(rng(position.NumAvailableMoves()));
+      } while (!position.CellIsEmpty(cell));
+      if (position.MakePermanentMove(static_cast<Player>(i & 1), cell) !=
+          kNoWinningCondition) {
+        break;
+      }
+    }
+    std::vector<std::vector<std::pair<Player, Cell> > > lines(kLines);
+    long long moves = 0;
+    for (int line = 0; line < kLines; ++line) {
+      Memento memento;
+      MakeMergingLine(&rng, kDepth, &position, &memento, &lines[line]);
+      memento.UndoAll();
+      moves += lines[line].size();
+    }
+    UndoLog undo_log;
+    const double start = Now();
+    for (int r = 0; r < kRepeats; ++r) {
+      for (int line = 0; line < kLines; ++line) {
+        Memento memento(&undo_log);
+        for (size_t i = 0; i < lines[line].size(); ++i) {
+          position.MakeMoveReversibly(
+              lines[line][i].first, lines[line][i].second, &memento);
+        }
+        memento.UndoAll();
+      }
+    }
+    const double seconds = Now() - start;
+    printf("%6d %8lld %8.1f\n", position.MoveCount(), moves,
+           1e9 * seconds / (kRepeats * moves));
+  }
+}
+
+// Measures how long it takes to make and undo a move of a player
+// whose stones lie on the lattice of cells where each stone makes
+// two-bridges with six others, so that the graph of two-bridges
+// has very many cycles.
+void BenchmarkRingFrames() {
+  static const int kStoneCounts[] = { 10, 20, 30, 40, 50, 60, 70, 80 };
+  const int kRepeats = 20;
+  printf("rings: stones, ring frames, us per move\n");
+  std::vector<Cell> lattice;
+  for (Cell cell = kZerothCell; cell < kNumCellsWithSentinels;
+       cell = NextCell(cell)) {
+    if (LiesOnBoard(CellToX(cell), CellToY(cell)) &&
+        (CellToX(cell) + 2 * CellToY(cell)) % 3 == 0) {
+      lattice.push_back(cell);
+    }
+  }
+  Rng rng;
+  rng.Init(12345);
+  rng.Shuffle(lattice.begin(), lattice.end());
+  for (int s = 0; s < ARRAYSIZE(kStoneCounts); ++s) {
+    if (kStoneCounts[s] >= static_cast<int>(lattice.size()))
+      break;
+    Position position;
+    position.InitToStartPosition();
+    int stones = 0;
+    while (stones < kStoneCounts[s] &&
+           position.MakePermanentMove(kWhite, lattice[stones]) ==
+           kNoWinningCondition) {
+      ++stones;
+    }
+    if (stones < kStoneCounts[s])
+      break;
+    UndoLog undo_log;
+    long long moves = 0;
+    const double start = Now();
+    for (int r = 0; r < kRepeats; ++r) {
+      for (size_t i = stones; i < lattice.size(); ++i) {
+        Memento memento(&undo_log);
+        position.MakeMoveReversibly(kWhite, lattice[i], &memento);
+        memento.UndoAll();
+        ++moves;
+      }
+    }
+    const double seconds = Now() - start;
+    printf("%6d %6d %8.2f\n", stones,
+           position.player_position(kWhite).ring_frame_count(),
+           1e6 * seconds / moves);
+  }
+}
+
+struct Benchmark {
+  const char* name;
+  void (*function)();
+};
+
+const Benchmark kBenchmarks[] = {
+  { "chains", BenchmarkChainLookup },
+  { "perft", BenchmarkPerft },
+  { "copy", BenchmarkCopy },
+  { "nps", BenchmarkNodesPerSecond },
+  { "merges", BenchmarkMerges },
+  { "rings", BenchmarkRingFrames },
+};
+
+}  // namespace
+}  // namespace lajkonik
+
+int main(int argc, char* argv[]) {
+  using lajkonik::kBenchmarks;
+  lajkonik::Position::InitStaticFields();
+  bool found = false;
+  for (int i = 0; i < ARRAYSIZE(kBenchmarks); ++i) {
+    if (argc < 2 || strcmp(argv[1], kBenchmarks[i].name) == 0) {
+      kBenchmarks[i].function();
+      found = true;
+    }
+  }
+  if (!found) {
+    fprintf(stderr, "Unknown benchmark %s\n", argv[1]);
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
@@ -30,17 +30,20 @@
 #include "wfhashmap.h"
 
 #include <assert.h>
+#include <ctype.h>
 #include <limits.h>
 #include <setjmp.h>
 #include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <sys/time.h>
 
 #include <algorithm>
 
 namespace lajkonik {
+namespace SIZED_NAMESPACE {
 
 namespace {
 
@@ -50,6 +53,15 @@ const int kWon = -101;
 const int kLost = +10000;
 const int kInfinity = 2 * kLost;
 const int kDraw = 0.5 * kLost;
+// One-distances from the edges cost about as much as evaluating a chain,
+// so they are computed only when at least kMinChainsToPrune chains have
+// bounds from two-distances kMinPruningMargin or more above the baseline.
+// Chains nearer to it are rarely pruned. So are chains that two-distances
+// do not join with some pair of edges, whose bounds reach
+// BfsResult::kMaxDistance: crowded boards have many of them, but their
+// one-distances are mostly short.
+const int kMinChainsToPrune = 2;
+const int kMinPruningMargin = 10;
 
 const uint64 kAttackerPassHash = -0xdeadbeefdeadbeefULL;
 const uint64 kDefenderPassHash = +0xdeadbeefdeadbeefULL;
@@ -77,8 +89,10 @@ bool CellEvalCompareDesc(const CellEval& ce1, const CellEval& ce2) {
   }
 }
 
+// Values of kProven nodes come from static proofs, so they hold
+// whatever the depth of the search.
 enum Kind {
-  kExact, kAlpha, kBeta
+  kExact, kAlpha, kBeta, kProven
 };
 
 struct EvalKindDepthMoves {
@@ -88,8 +102,78 @@ struct EvalKindDepthMoves {
   unsigned moves_index: 32;
 };
 
+// The intersection of the carriers of the shortest frames of a player,
+// that is the empty cells where the opponent has to play to lengthen
+// all of them.
+class MustPlayRegion {
+ public:
+  MustPlayRegion() {}
+  ~MustPlayRegion() {}
+
+  // Starts with no frames and all empty cells in the region.
+  void Init(const PlayerPosition& pp, const PlayerPosition& op) {
+    length_ = BfsResult::kMaxDistance;
+    for (YCoord y = kZeroY; y < kBoardHeight; y = NextY(y)) {
+      empty_cells_.Row(y) = Position::GetBoardBitmask().Row(y) &
+          ~pp.stone_mask().Row(y) & ~op.stone_mask().Row(y);
+    }
+    region_.CopyFrom(empty_cells_);
+  }
+
+  // Returns true if a frame of the given length can narrow the region.
+  bool Admits(int length) const {
+    return length < BfsResult::kMaxDistance && length <= length_;
+  }
+
+  // Adds to carrier the empty cells on the paths of the given length
+  // between the start chains of from_first and from_second.
+  void AddPathsToCarrier(
+      const BfsResult& from_first,
+      const BfsResult& from_second,
+      int length,
+      BoardBitmask* carrier) const {
+    for (YCoord y = kZeroY; y < kBoardHeight; y = NextY(y)) {
+      RowBitmask row = empty_cells_.Row(y);
+      for (XCoord x = kZeroX; row != 0; x = NextX(x), row >>= 1) {
+        const Cell cell = XYToCell(x, y);
+        if ((row & 1) &&
+            from_first.get(cell) + from_second.get(cell) < length) {
+          carrier->set(x, y);
+        }
+      }
+    }
+  }
+
+  // Narrows the region to the carrier of a frame that needs
+  // the given number of moves.
+  void AddFrame(int length, const BoardBitmask& carrier) {
+    if (length < length_) {
+      length_ = length;
+      region_.FillWithAnd(empty_cells_, carrier);
+    } else if (length == length_) {
+      region_.FillWithAnd(region_, carrier);
+    }
+  }
+
+  const BoardBitmask& region() const { return region_; }
+  // Returns true if some frame narrowed the region to a nonempty set.
+  bool IsNarrowed() const {
+    return length_ < BfsResult::kMaxDistance && !region_.IsZero();
+  }
+
+ private:
+  BoardBitmask empty_cells_;
+  BoardBitmask region_;
+  int length_;
+
+  MustPlayRegion(const MustPlayRegion&);
+  void operator=(const MustPlayRegion&);
+};
+
 void EvaluateRingFrames(
-    const PlayerPosition& pp, PositionEvaluation* evaluation) {
+    const PlayerPosition& pp,
+    PositionEvaluation* evaluation,
+    MustPlayRegion* must_play) {
   for (int i = 0, size = pp.ring_frame_count(); i < size; ++i) {
     const unsigned* frame = pp.ring_frame(i);
     if (frame == NULL)
@@ -102,33 +186,112 @@ void EvaluateRingFrames(
       m = Position::CellToMoveIndex(static_cast<Cell>(frame[2 * j + 2]));
       evaluation->set(m, std::min(evaluation->get(m), moves_to_win));
     }
+    if (must_play != NULL && must_play->Admits(frame[0])) {
+      BoardBitmask carrier;
+      carrier.ZeroBits();
+      for (int j = 1; j <= 2 * static_cast<int>(frame[0]); ++j) {
+        const Cell cell = static_cast<Cell>(frame[j]);
+        carrier.set(CellToX(cell), CellToY(cell));
+      }
+      must_play->AddFrame(frame[0], carrier);
+    }
   }
 }
 
 void EvaluateBridgeFrames(
     const PlayerPosition& pp,
     const PlayerPosition& op,
-    PositionEvaluation* evaluation) {
+    PositionEvaluation* evaluation,
+    MustPlayRegion* must_play) {
   BfsResult from_corner[6];
   for (int i = 0; i < 6; ++i) {
     const Chain* corner_chain = Position::GetCornerChain(i);
     pp.ComputeTwoDistance(corner_chain, op, &from_corner[i]);
   }
-  PositionEvaluation tmp;
+  evaluation->SetToMinimumWithBridgeFrames(from_corner);
+  if (must_play == NULL)
+    return;
   for (int i = 0; i < 6; ++i) {
     for (int j = i + 1; j < 6; ++j) {
-      tmp.SetToCombination(
-          from_corner[i], from_corner[j],
-          Position::GetCornerChain(i), Position::GetCornerChain(j));
-      evaluation->SetToMinimum(*evaluation, tmp);
+      const int length = std::max(
+          from_corner[i].GetTwoDistance(Position::GetCornerChain(j)),
+          from_corner[j].GetTwoDistance(Position::GetCornerChain(i)));
+      if (!must_play->Admits(length))
+        continue;
+      BoardBitmask carrier;
+      carrier.ZeroBits();
+      must_play->AddPathsToCarrier(
+          from_corner[i], from_corner[j], length, &carrier);
+      must_play->AddFrame(length, carrier);
+    }
+  }
+}
+
+// A move shortens the path between the chain and an edge by at most one
+// cell, so with one-distances from the edges this bounds from below what
+// the fork frames of the chain contribute to any move. One-distances never
+// exceed two-distances, so with the latter it bounds that bound from above.
+int ForkFrameBound(const BfsResult from_edge[6], const Chain* chain) {
+  int bound[6];
+  for (int j = 0; j < 6; ++j) {
+    bound[j] = std::max(from_edge[j].GetTwoDistance(chain) - 1, 0);
+  }
+  return ShortestForkFrame(bound);
+}
+
+// Narrows the must-play region to the carriers of the shortest fork
+// frames of the chain, one for each partition of the edges into pairs.
+void AddForkFramesToMustPlayRegion(
+    const BfsResult& from_chain,
+    const Chain* chain,
+    const BfsResult from_edge[6],
+    MustPlayRegion* must_play) {
+  int distance[6];
+  for (int j = 0; j < 6; ++j) {
+    distance[j] = from_edge[j].GetTwoDistance(chain);
+  }
+  const int length = ShortestForkFrame(distance);
+  if (!must_play->Admits(length))
+    return;
+  for (int k = 0; k < 3; ++k) {
+    const int* p = kForkPartitions[k];
+    if (ForkFrameLength(distance, p) != length)
+      continue;
+    BoardBitmask carrier;
+    carrier.ZeroBits();
+    for (int j = 0; j < 6; j += 2) {
+      const int leg = std::min(distance[p[j]], distance[p[j + 1]]);
+      for (int e = j; e < j + 2; ++e) {
+        if (distance[p[e]] == leg) {
+          must_play->AddPathsToCarrier(
+              from_chain, from_edge[p[e]], leg, &carrier);
+        }
+      }
     }
+    must_play->AddFrame(length, carrier);
+  }
+}
+
+void EvaluateForkFramesOfChain(
+    const PlayerPosition& pp,
+    const PlayerPosition& op,
+    const Chain* chain,
+    const BfsResult from_edge[6],
+    PositionEvaluation* evaluation,
+    MustPlayRegion* must_play) {
+  BfsResult from_center;
+  pp.ComputeTwoDistance(chain, op, &from_center);
+  evaluation->SetToMinimumWithForkFrames(from_center, chain, from_edge);
+  if (must_play != NULL) {
+    AddForkFramesToMustPlayRegion(from_center, chain, from_edge, must_play);
   }
 }
 
 void EvaluateForkFrames(
     const PlayerPosition& pp,
     const PlayerPosition& op,
-    PositionEvaluation* evaluation) {
+    PositionEvaluation* evaluation,
+    MustPlayRegion* must_play) {
   std::set<const Chain*> current_chains;
   pp.GetCurrentChains(&current_chains);
   if (current_chains.empty()) {
@@ -139,48 +302,88 @@ void EvaluateForkFrames(
     const Chain* edge_chain = Position::GetEdgeChain(i);
     pp.ComputeTwoDistance(edge_chain, op, &from_edge[i]);
   }
+  // Chains whose bound from two-distances is below the baseline cannot be
+  // pruned, so we evaluate them first, in the order of that bound. The
+  // baseline only goes down, so the remaining chains might all be pruned.
+  std::vector<std::pair<int, const Chain*> > chains;
+  chains.reserve(current_chains.size());
   for (std::set<const Chain*>::const_iterator it = current_chains.begin();
        it != current_chains.end(); ++it) {
-    BfsResult from_center;
-    PositionEvaluation from_outside[6];
-    pp.ComputeTwoDistance(*it, op, &from_center);
-    for (int j = 0; j < 6; ++j) {
-      from_outside[j].SetToCombination(
-          from_center, from_edge[j],
-          *it, Position::GetEdgeChain(j));
-    }
-    PositionEvaluation tmp1;
-    PositionEvaluation tmp2;
-    PositionEvaluation tmp3;
-    tmp1.SetToMinimum(from_outside[0], from_outside[1]);
-    tmp2.SetToMinimum(from_outside[2], from_outside[3]);
-    tmp1.SetToSum(tmp1, tmp2);
-    tmp2.SetToMinimum(from_outside[5], from_outside[4]);
-    tmp3.SetToSum(tmp1, tmp2);
-    tmp1.SetToMinimum(from_outside[0], from_outside[4]);
-    tmp2.SetToMinimum(from_outside[2], from_outside[1]);
-    tmp1.SetToSum(tmp1, tmp2);
-    tmp2.SetToMinimum(from_outside[5], from_outside[3]);
-    tmp1.SetToSum(tmp1, tmp2);
-    tmp3.SetToMinimum(tmp3, tmp1);
-    tmp1.SetToMinimum(from_outside[0], from_outside[3]);
-    tmp2.SetToMinimum(from_outside[2], from_outside[4]);
-    tmp1.SetToSum(tmp1, tmp2);
-    tmp2.SetToMinimum(from_outside[5], from_outside[1]);
-    tmp1.SetToSum(tmp1, tmp2);
-    tmp3.SetToMinimum(tmp3, tmp1);
-    evaluation->SetToMinimum(*evaluation, tmp3);
+    chains.push_back(std::make_pair(ForkFrameBound(from_edge, *it), *it));
+  }
+  std::sort(chains.begin(), chains.end());
+  size_t i = 0;
+  for (; i < chains.size() &&
+         chains[i].first < evaluation->get_baseline_distance(); ++i) {
+    EvaluateForkFramesOfChain(
+        pp, op, chains[i].second, from_edge, evaluation, must_play);
+  }
+  int num_far_chains = 0;
+  for (size_t j = i; j < chains.size(); ++j) {
+    if (chains[j].first >=
+            evaluation->get_baseline_distance() + kMinPruningMargin &&
+        chains[j].first < BfsResult::kMaxDistance)
+      ++num_far_chains;
+  }
+  if (num_far_chains < kMinChainsToPrune) {
+    for (; i < chains.size(); ++i) {
+      EvaluateForkFramesOfChain(
+          pp, op, chains[i].second, from_edge, evaluation, must_play);
+    }
+    return;
+  }
+  // Cutting one-distances at the baseline yields the same bounds below it.
+  BfsResult one_distance[6];
+  pp.ComputeOneDistancesFromEdges(
+      op,
+      std::min(evaluation->get_baseline_distance(),
+               BfsResult::kMaxDistance - 1),
+      one_distance);
+  for (; i < chains.size(); ++i) {
+    if (ForkFrameBound(one_distance, chains[i].second) <
+        evaluation->get_baseline_distance()) {
+      EvaluateForkFramesOfChain(
+          pp, op, chains[i].second, from_edge, evaluation, must_play);
+    }
+  }
+}
+
+// Lowers the distances of the cells in the carrier of the frame that
+// the virtual connections of the player found and the baseline to the
+// length of the frame.
+void EvaluateVirtualConnections(
+    const VirtualConnections& virtual_connections,
+    PositionEvaluation* evaluation) {
+  const int moves_to_win = virtual_connections.moves() - 1;
+  const BoardBitmask& carrier = virtual_connections.carrier();
+  for (YCoord y = kGapAround; y < kPastRows; y = NextY(y)) {
+    for (RowBitmask row = carrier.Row(y); row != 0; row &= row - 1) {
+      const XCoord x = static_cast<XCoord>(CountTrailingZeroes(row));
+      const MoveIndex m = Position::CellToMoveIndex(XYToCell(x, y));
+      evaluation->set(m, std::min(evaluation->get(m), moves_to_win));
+    }
   }
+  evaluation->set(
+      kNumMovesOnBoard,
+      std::min(evaluation->get_baseline_distance(), moves_to_win + 1));
 }
 
+// Evaluates the position for the player.  If must_play is not NULL,
+// also computes where the opponent must play against the player.
 void EvaluateForPlayer(
-    const Position* position, Player player, PositionEvaluation* evaluation) {
+    const Position* position,
+    Player player,
+    PositionEvaluation* evaluation,
+    MustPlayRegion* must_play) {
   const PlayerPosition& pp = position->player_position(player);
   const PlayerPosition& op = position->player_position(Opponent(player));
   evaluation->SetAllMovesTo(BfsResult::kMaxDistance);
-  EvaluateForkFrames(pp, op, evaluation);
-  EvaluateBridgeFrames(pp, op, evaluation);
-  EvaluateRingFrames(pp, evaluation);
+  if (must_play != NULL)
+    must_play->Init(pp, op);
+  // Bridge frames go first to tighten the bound for pruning fork frames.
+  EvaluateBridgeFrames(pp, op, evaluation, must_play);
+  EvaluateForkFrames(pp, op, evaluation, must_play);
+  EvaluateRingFrames(pp, evaluation, must_play);
 }
 
 // TODO.
@@ -251,6 +454,9 @@ class Searcher {
     for (size_t i = 0; i < vectors_.size(); ++i) {
       delete vectors_[i];
     }
+    for (size_t i = 0; i < must_play_regions_.size(); ++i) {
+      delete must_play_regions_[i];
+    }
   }
 
   static void* SearchForAttacker(void* self) {
@@ -269,6 +475,17 @@ class Searcher {
 
   bool solved() const { return solved_; }
 
+  // Returns the number of the attacker's moves to the win that a search
+  // to max_depth proved, or 0 if it proved none. Stores the first of them
+  // in move.
+  int CountMovesToWin(int max_depth, Cell* move) const {
+    const EvalKindDepthMoves* root = tt_->FindValue(0ULL);
+    if (root == NULL || root->value > kWon + kPotentialScale * max_depth)
+      return 0;
+    *move = (*vectors_[root->moves_index])[0].cell;
+    return (root->value - kWon) / kPotentialScale + 1;
+  }
+
   int tt_size() const { return tt_->num_elements(); }
 
  private:
@@ -277,13 +494,15 @@ class Searcher {
       int depth;
       for (depth = 0; depth < *max_depth_; ++depth) {
         Attack(0ULL, -kInfinity, +kInfinity, depth, 0, 2 * depth, false);
-        std::string main_variation = PrincipalVariation(0ULL, attacker_);
-        std::string pass_variation =
-            PrincipalVariation(kAttackerPassHash, defender_);
-        logger_->Log(StringPrintf(
-            "A%d %d %s |%s",
-            depth, tt_size(),
-            main_variation.c_str(), pass_variation.c_str()));
+        if (logger_ != NULL) {
+          std::string main_variation = PrincipalVariation(0ULL, attacker_);
+          std::string pass_variation =
+              PrincipalVariation(kAttackerPassHash, defender_);
+          logger_->Log(StringPrintf(
+              "A%d %d %s |%s",
+              depth, tt_size(),
+              main_variation.c_str(), pass_variation.c_str()));
+        }
         EvalKindDepthMoves* root = tt_->FindValue(0ULL);
         assert(root != NULL);
         assert(root->moves_index != 0);
@@ -339,10 +558,11 @@ class Searcher {
     if (node == NULL) {
       moves_index = 0;
     } else {
-      if (node->depth == depth &&
-          (node->kind == kExact ||
-          (node->kind == kAlpha && node->value <= alpha) ||
-          (node->kind == kBeta && node->value >= beta))) {
+      if (node->kind == kProven ||
+          (node->depth == depth &&
+           (node->kind == kExact ||
+           (node->kind == kAlpha && node->value <= alpha) ||
+           (node->kind == kBeta && node->value >= beta)))) {
         return node->value;
       }
 //      if (node->value - 2.5 * kPotentialScale > beta) {
@@ -351,8 +571,29 @@ class Searcher {
       moves_index = node->moves_index;
       assert(moves_index != 0);
     }
+    // Nodes at level 1 keep their moves, which tell the defender at the root
+    // where to play.
+    const VirtualConnections* frame = NULL;
+    if (moves_index == 0 && level > 1) {
+      if (AttackerHasWinInOne()) {
+        BoardBitmask winning_cell;
+        GetFirstWinningCellOfAttacker(&winning_cell);
+        return StoreProof(node, hash, kWon, winning_cell);
+      }
+      if (AttackerHasFrame()) {
+        if (DefenderCannotWinFirst()) {
+          return StoreProof(
+              node, hash,
+              kWon + kPotentialScale *
+                  (virtual_connections_.moves_if_intruded() - 1),
+              virtual_connections_.carrier());
+        }
+        frame = &virtual_connections_;
+      }
+    }
     if (moves_index == 0) {
-      moves_index = ExpandMoves(attacker_, level);
+      moves_index = ExpandMoves(
+          attacker_, level, last_move_was_defender_pass, frame);
     }
     std::vector<CellEval>& moves = *vectors_[moves_index];
     int value = kDraw;
@@ -371,7 +612,7 @@ class Searcher {
       kind = kExact;
     } else {
       kind = kBeta;
-      Memento memento;
+      Memento memento(&undo_log_);
       size_t i;
       for (i = 0; i < moves.size(); ++i) {
         if (moves[i].cell == kZerothCell) {
@@ -478,7 +719,7 @@ for (size_t i = 0; i < moves.size(); ++i) {
     std::vector<CellEval>& moves = *vectors_[moves_index];
     int value;
     Kind kind = kAlpha;
-    Memento memento;
+    Memento memento(&undo_log_);
     size_t i;
     for (i = 0; i < moves.size(); ++i) {
       if (moves[i].cell == kZerothCell) {
@@ -575,33 +816,150 @@ for (size_t i = 0; i < moves.size(); ++i) {
     assert(attack_node != NULL);
     assert(attack_node->moves_index != 0);
     const std::vector<CellEval>& attacks = *vectors_[attack_node->moves_index];
-    const int size = moves->size();
-    if (size == 1) {
-      for (size_t i = 0; i < attacks.size(); ++i) {
-        if (attacks[i].value > attacks[0].value)
+    const BoardBitmask* must_play = GetMustPlayRegion(attack_node->moves_index);
+    if (must_play != NULL) {
+      // Ignore a region that misses all the best replies of the attacker.
+      size_t i;
+      for (i = 0; i < attacks.size(); ++i) {
+        if (attacks[i].value > attacks[0].value ||
+            IsInMask(attacks[i].cell, *must_play))
           break;
+      }
+      if (i == attacks.size() || attacks[i].value > attacks[0].value)
+        must_play = NULL;
+    }
+    const int size = moves->size();
+    assert(size >= 1);
+    for (size_t i = 0; i < attacks.size(); ++i) {
+      if (attacks[i].value > attacks[0].value)
+        break;
+      if (must_play != NULL && !IsInMask(attacks[i].cell, *must_play))
+        continue;
+      if (size == 1 || !SubvectorContainsCell(
+          moves->begin(), moves->begin() + size, attacks[i].cell)) {
         moves->push_back(attacks[i]);
       }
-    } else {
-      assert(size > 1);
-      for (size_t i = 0; i < attacks.size(); ++i) {
-        if (attacks[i].value > attacks[0].value)
-          break;
-        if (!SubvectorContainsCell(
-            moves->begin(), moves->begin() + size, attacks[i].cell)) {
-          moves->push_back(attacks[i]);
-        }
+    }
+  }
+
+  // Returns the cells where the defender must play in the position
+  // of the attacker's node, or NULL if any move may be relevant.
+  const BoardBitmask* GetMustPlayRegion(int moves_index) const {
+    if (static_cast<size_t>(moves_index) >= must_play_regions_.size())
+      return NULL;
+    return must_play_regions_[moves_index];
+  }
+
+  // Remembers the must-play region for the node of the attacker.
+  void SetMustPlayRegion(int moves_index, const MustPlayRegion& must_play) {
+    if (!must_play.IsNarrowed())
+      return;
+    if (must_play_regions_.size() <= static_cast<size_t>(moves_index))
+      must_play_regions_.resize(moves_index + 1, NULL);
+    must_play_regions_[moves_index] = new BoardBitmask;
+    must_play_regions_[moves_index]->CopyFrom(must_play.region());
+  }
+
+  // Returns true if the attacker can win with his next stone.
+  bool AttackerHasWinInOne() {
+    return !position_.player_position(attacker_).winning_cells().IsZero();
+  }
+
+  // After AttackerHasWinInOne() returned true: sets in result only one
+  // of his winning cells, the first in the order of rows and columns.
+  void GetFirstWinningCellOfAttacker(BoardBitmask* result) const {
+    const BoardBitmask& winning_cells =
+        position_.player_position(attacker_).winning_cells();
+    result->ZeroBits();
+    YCoord y = kGapAround;
+    while (winning_cells.Row(y) == 0) {
+      y = NextY(y);
+    }
+    const RowBitmask row = winning_cells.Row(y);
+    result->Row(y) = row & ~(row - 1);
+  }
+
+  // Returns true if the virtual connections of the attacker join a frame.
+  bool AttackerHasFrame() {
+    return virtual_connections_.FindFrame(
+        position_.player_position(attacker_),
+        position_.player_position(defender_));
+  }
+
+  // After AttackerHasFrame() returned true: returns true if the defender
+  // cannot win before the attacker connects his frame. Each move of the
+  // defender, be it an intrusion or not, lets the attacker make one of his
+  // at most moves_if_intruded() moves, so the defender gets one move fewer.
+  // Rings are bounded only up to two stones, so longer frames prove nothing.
+  bool DefenderCannotWinFirst() {
+    const PlayerPosition& ap = position_.player_position(attacker_);
+    const PlayerPosition& dp = position_.player_position(defender_);
+    const int defender_moves = virtual_connections_.moves_if_intruded() - 1;
+    if (defender_moves > 2 ||
+        dp.BoundMovesToWin(ap, defender_moves) <= defender_moves) {
+      return false;
+    }
+    return defender_moves < 2 || !DefenderWinsWithTwoStones();
+  }
+
+  // Returns true if two stones win for the defender, who has no winning
+  // cells. One of them touches his stones, as no two new stones win alone.
+  bool DefenderWinsWithTwoStones() {
+    const PlayerPosition& dp = position_.player_position(defender_);
+    BoardBitmask liberties;
+    liberties.FillWithNeighborMask(
+        dp.stone_mask(), position_.player_position(attacker_).stone_mask());
+    Memento memento(&undo_log_);
+    for (YCoord y = kGapAround; y < kPastRows; y = NextY(y)) {
+      for (RowBitmask row = liberties.Row(y); row != 0; row &= row - 1) {
+        const XCoord x = static_cast<XCoord>(CountTrailingZeroes(row));
+        position_.MakeMoveReversibly(defender_, XYToCell(x, y), &memento);
+        const bool wins = !dp.winning_cells().IsZero();
+        memento.UndoAll();
+        if (wins)
+          return true;
+      }
+    }
+    return false;
+  }
+
+  // Stores the node as proven to have the value and gives it the cells
+  // of the proof as its moves, so that the principal variation and
+  // the defender's replies after a pass show them. Returns the value.
+  int StoreProof(
+      EvalKindDepthMoves* node, Hash hash, int value,
+      const BoardBitmask& cells) {
+    if (node == NULL) {
+      node = tt_->InsertKey(hash);
+    }
+    if (node == NULL)
+      return value;
+    node->value = value;
+    node->kind = kProven;
+    node->depth = 0;
+    node->moves_index = vectors_.size();
+    vectors_.push_back(new std::vector<CellEval>);
+    std::vector<CellEval>& moves = *vectors_.back();
+    for (YCoord y = kGapAround; y < kPastRows; y = NextY(y)) {
+      for (RowBitmask row = cells.Row(y); row != 0; row &= row - 1) {
+        const XCoord x = static_cast<XCoord>(CountTrailingZeroes(row));
+        moves.push_back(CellEval(XYToCell(x, y), value));
       }
     }
+    sort(moves.begin(), moves.end(), CellEvalCompareAsc);
+    return value;
   }
 
-  static bool IsInMaskOrTwiceAdjacent(Cell cell, const BoardBitmask& mask) {
-    const XCoord x = CellToX(cell);
-    const YCoord y = CellToY(cell);
-    return (mask.get(x, y) || CountSetBits(mask.Get6Neighbors(x, y)) >= 2);
+  static bool IsInMask(Cell cell, const BoardBitmask& mask) {
+    return mask.get(CellToX(cell), CellToY(cell));
   }
 
-  int ExpandMoves(Player player, int level) {
+  // Also computes the must-play region if after_defender_pass is true.
+  // Frame, if not NULL, holds the frame of the player that his virtual
+  // connections found.
+  int ExpandMoves(
+      Player player, int level, bool after_defender_pass,
+      const VirtualConnections* frame) {
     const int moves_index = vectors_.size();
     vectors_.push_back(new std::vector<CellEval>);
     std::vector<CellEval>& moves = *vectors_[moves_index];
@@ -610,10 +968,12 @@ for (size_t i = 0; i < moves.size(); ++i) {
     if (position_.MoveCount() == 0) {
       baseline_value = (SIDE_LENGTH + 1) * (SIDE_LENGTH + 1) / 3;
       for (YCoord y = kMiddleRow; y < kPastRows; y = NextY(y)) {
-        for (XCoord x = kMiddleColumn; x <= static_cast<XCoord>(y);
-             x = NextX(x)) {
-          if (!Position::GetBoardBitmask().get(x, y))
-            continue;
+        // The cells of the board from kMiddleColumn to y.
+        RowBitmask row = Position::GetBoardBitmask().Row(y) &
+            (BoardBitmask::Bit(static_cast<XCoord>(y + 1)) -
+             BoardBitmask::Bit(kMiddleColumn));
+        for (/**/; row != 0; row &= row - 1) {
+          const XCoord x = static_cast<XCoord>(CountTrailingZeroes(row));
           const Cell cell = XYToCell(x, y);
           assert(position_.CellIsEmpty(cell));
           moves.push_back(CellEval(cell, kPotentialScale * baseline_value));
@@ -621,16 +981,22 @@ for (size_t i = 0; i < moves.size(); ++i) {
       }
     } else if (position_.MoveCount() == 1) {
       baseline_value = (SIDE_LENGTH + 1) * (SIDE_LENGTH + 1) / 3;
-      for (MoveIndex move = kZerothMove,
-           num_moves = position_.NumAvailableMoves();
-           move < num_moves; move = NextMove(move)) {
-        const Cell cell = Position::MoveIndexToCell(move);
+      for (int n = 0, num_moves = position_.NumAvailableMoves();
+           n < num_moves; ++n) {
+        const Cell cell = position_.NthAvailableCell(n);
         if (position_.CellIsEmpty(cell)) {
           moves.push_back(CellEval(cell, kPotentialScale * baseline_value));
         }
       }
     } else {
-      EvaluateForPlayer(&position_, player, &position_evaluation_);
+      MustPlayRegion must_play;
+      EvaluateForPlayer(
+          &position_, player, &position_evaluation_,
+          after_defender_pass ? &must_play : NULL);
+      if (frame != NULL)
+        EvaluateVirtualConnections(*frame, &position_evaluation_);
+      if (after_defender_pass)
+        SetMustPlayRegion(moves_index, must_play);
       baseline_value = position_evaluation_.get_baseline_distance();
       const BoardBitmask& player_stones =
           position_.player_position(player).stone_mask();
@@ -638,14 +1004,17 @@ for (size_t i = 0; i < moves.size(); ++i) {
           position_.player_position(Opponent(player)).stone_mask();
       BoardBitmask player_neighbors;
       player_neighbors.FillWithNeighborMask(player_stones, opponent_stones);
-      for (MoveIndex move = kZerothMove,
-           num_moves = position_.NumAvailableMoves();
-           move < num_moves; move = NextMove(move)) {
-        const Cell cell = Position::MoveIndexToCell(move);
+      BoardBitmask near_player;
+      near_player.FillWithMaskOrTwiceAdjacent(player_neighbors);
+      for (int n = 0, num_moves = position_.NumAvailableMoves();
+           n < num_moves; ++n) {
+        const Cell cell = position_.NthAvailableCell(n);
         if (position_.CellIsEmpty(cell)) {
-          const int value = position_evaluation_.get(move);
-          if (value < baseline_value ||
-              IsInMaskOrTwiceAdjacent(cell, player_neighbors)) {
+          const int value =
+              position_evaluation_.get(Position::CellToMoveIndex(cell));
+          if ((value < baseline_value ||
+               IsInMask(cell, near_player)) &&
+              !position_.CellIsDeadForPlayer(player, cell)) {
             moves.push_back(CellEval(cell, kPotentialScale * value));
           }
         }
@@ -712,14 +1081,20 @@ for (size_t i = 0; i < moves.size(); ++i) {
   bool solved_;
 
   Position position_;
+  // Holds the changes of position_ made by all Mementoes of the search.
+  UndoLog undo_log_;
   Player attacker_;
   Player defender_;
   PositionEvaluation position_evaluation_;
+  // Proves wins of the attacker in new nodes and points to his frames.
+  VirtualConnections virtual_connections_;
 
   // The underlying transposition table.
   TranspositionTable* tt_;
 
   std::vector<std::vector<CellEval>*> vectors_;
+  // Indexed like vectors_; NULL where no region is known.
+  std::vector<BoardBitmask*> must_play_regions_;
 
   jmp_buf come_back_;
 
@@ -740,6 +1115,162 @@ void create_thread(
 
 }  // namespace
 
+bool DescribesBoard(const std::string& description) {
+  if (description.find('.') != std::string::npos)
+    return true;
+  std::string::size_type end = 0;
+  while (true) {
+    const std::string::size_type begin =
+        description.find_first_not_of(" \t\r\n", end);
+    if (begin == std::string::npos)
+      return false;
+    end = description.find_first_of(" \t\r\n", begin);
+    const std::string::size_type length =
+        (end == std::string::npos ? description.size() : end) - begin;
+    if (length == 1 &&
+        (description[begin] == 'x' || description[begin] == 'o'))
+      return true;
+  }
+}
+
+namespace {
+
+// Puts the stones of a board or of a list of moves on the position,
+// parsing a board into the scratch Position first.
+// Returns false if the description is invalid.
+bool PlaceStones(
+    const std::string& description, Position* scratch, Position* position,
+    Memento* memento) {
+  if (DescribesBoard(description)) {
+    if (!scratch->ParseString(description))
+      return false;
+    for (MoveIndex move = kZerothMove; move < kNumMovesOnBoard;
+         move = NextMove(move)) {
+      const Cell cell = Position::MoveIndexToCell(move);
+      if (!scratch->CellIsEmpty(cell)) {
+        const Player player = static_cast<Player>(scratch->GetCell(cell) - 1);
+        position->MakeMoveReversibly(player, cell, memento);
+      }
+    }
+    return true;
+  }
+  Player player = kWhite;
+  std::string::size_type end = 0;
+  while (true) {
+    const std::string::size_type begin =
+        description.find_first_not_of(" \t\r\n", end);
+    if (begin == std::string::npos)
+      return true;
+    end = description.find_first_of(" \t\r\n", begin);
+    std::string move = description.substr(begin, end - begin);
+    for (size_t i = 0; i < move.size(); ++i) {
+      move[i] = tolower(move[i]);
+    }
+    const Cell cell = FromString(move);
+    if (cell == kZerothCell || !position->CellIsEmpty(cell))
+      return false;
+    position->MakeMoveReversibly(player, cell, memento);
+    player = Opponent(player);
+  }
+}
+
+// The state shared by the threads of EvaluateBatch().
+class Batch {
+ public:
+  Batch(const std::vector<std::string>& positions, FILE* output)
+      : positions_(positions),
+        output_(output),
+        lines_(positions.size()),
+        is_done_(positions.size(), false),
+        num_started_(0),
+        num_written_(0),
+        num_valid_(0) {
+    if (pthread_mutex_init(&mutex_, NULL) != 0) {
+      fprintf(stderr, "Cannot initialize a mutex\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+  ~Batch() {
+    if (pthread_mutex_destroy(&mutex_) != 0) {
+      fprintf(stderr, "Cannot destroy a mutex\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  static void* Work(void* self) {
+    static_cast<Batch*>(self)->EvaluatePositions();
+    return NULL;
+  }
+
+  int num_valid() const { return num_valid_; }
+
+ private:
+  void EvaluatePositions() {
+    // Allocated once per thread and reused for all its positions.
+    Position* position = new Position;
+    Position* scratch = new Position;
+    position->InitToStartPosition();
+    PositionEvaluation evaluation;
+    while (true) {
+      pthread_mutex_lock(&mutex_);
+      const size_t n = num_started_;
+      if (n < positions_.size())
+        ++num_started_;
+      pthread_mutex_unlock(&mutex_);
+      if (n >= positions_.size())
+        break;
+      Memento memento;
+      const bool is_valid =
+          PlaceStones(positions_[n], scratch, position, &memento);
+      std::string line;
+      if (is_valid) {
+        EvaluateForPlayer(position, kWhite, &evaluation, NULL);
+        const int white_evaluation = evaluation.GetEvaluation(*position);
+        EvaluateForPlayer(position, kBlack, &evaluation, NULL);
+        const int black_evaluation = evaluation.GetEvaluation(*position);
+        line = StringPrintf(
+            "%d %d %d\n",
+            static_cast<int>(n), white_evaluation, black_evaluation);
+      } else {
+        line = StringPrintf("%d ?\n", static_cast<int>(n));
+      }
+      memento.UndoAll();
+      Write(n, line, is_valid);
+    }
+    delete scratch;
+    delete position;
+  }
+
+  // Writes out the lines of all the positions done in order.
+  void Write(size_t n, const std::string& line, bool is_valid) {
+    pthread_mutex_lock(&mutex_);
+    lines_[n] = line;
+    is_done_[n] = true;
+    num_valid_ += is_valid;
+    while (num_written_ < lines_.size() && is_done_[num_written_]) {
+      fputs(lines_[num_written_].c_str(), output_);
+      std::string().swap(lines_[num_written_]);
+      ++num_written_;
+    }
+    fflush(output_);
+    pthread_mutex_unlock(&mutex_);
+  }
+
+  const std::vector<std::string>& positions_;
+  FILE* output_;
+  std::vector<std::string> lines_;
+  std::vector<bool> is_done_;
+  size_t num_started_;
+  size_t num_written_;
+  int num_valid_;
+  pthread_mutex_t mutex_;
+
+  Batch(const Batch&);
+  void operator=(const Batch&);
+};
+
+}  // namespace
+
 Engine::Engine()
     : has_swapped_(false),
       seconds_per_move_(20.0) {
@@ -783,8 +1314,9 @@ std::string Engine::SuggestMove(Player player_to_move, double thinking_time) {
   printf("%s", defend_evaluation.MakeString(&position_).c_str());
   int best_value = -kInfinity;
   MoveIndex best_move = kInvalidMove;
-  for (MoveIndex move = kZerothMove; move < position_.NumAvailableMoves();
-       move = NextMove(move)) {
+  for (int n = 0; n < position_.NumAvailableMoves(); ++n) {
+    const MoveIndex move =
+        Position::CellToMoveIndex(position_.NthAvailableCell(n));
     const int value = defend_evaluation.get(move) - attack_evaluation.get(move);
     if (value > best_value) {
       best_value = value;
@@ -842,20 +1374,20 @@ void Engine::EvaluatePartialGoal(
   const PlayerPosition& pp = position_.player_position(player);
   if (cell1 == kZerothCell && cell2 == kZerothCell) {
     evaluation->SetAllMovesTo(BfsResult::kMaxDistance);
-    EvaluateRingFrames(pp, evaluation);
+    EvaluateRingFrames(pp, evaluation, NULL);
     return;
   } else if (cell1 == kZerothCell && cell2 == static_cast<Cell>(-1)) {
     const PlayerPosition& op = position_.player_position(Opponent(player));
     evaluation->SetAllMovesTo(BfsResult::kMaxDistance);
-    EvaluateBridgeFrames(pp, op, evaluation);
+    EvaluateBridgeFrames(pp, op, evaluation, NULL);
     return;
   } else if (cell1 == kZerothCell && cell2 == static_cast<Cell>(-2)) {
     const PlayerPosition& op = position_.player_position(Opponent(player));
     evaluation->SetAllMovesTo(BfsResult::kMaxDistance);
-    EvaluateForkFrames(pp, op, evaluation);
+    EvaluateForkFrames(pp, op, evaluation, NULL);
     return;
   } else if (cell1 == kZerothCell && cell2 == static_cast<Cell>(-3)) {
-    EvaluateForPlayer(&position_, player, evaluation);
+    EvaluateForPlayer(&position_, player, evaluation, NULL);
     return;
   }
   const Chain* chain1p = NULL;
@@ -896,7 +1428,7 @@ std::string Engine::GetBoardString() const {
 
 std::string Engine::GetPlayerEvaluationString(Player player) const {
   PositionEvaluation evaluation;
-  EvaluateForPlayer(&position_, player, &evaluation);
+  EvaluateForPlayer(&position_, player, &evaluation, NULL);
   return evaluation.MakeString(&position_);
 }
 
@@ -909,7 +1441,7 @@ std::string Engine::GetPartialEvaluationString(
 
 int Engine::GetEvaluation(Player player) const {
   PositionEvaluation tmp;
-  EvaluateForPlayer(&position_, player, &tmp);
+  EvaluateForPlayer(&position_, player, &tmp, NULL);
   return tmp.GetEvaluation(position_);
 }
 
@@ -918,4 +1450,57 @@ bool Engine::DumpEvaluations(const std::vector<MoveIndex>& variant) {
   return size > 0;
 }
 
+bool ReadBatch(const char* file_name, std::vector<std::string>* positions) {
+  FILE* file = fopen(file_name, "r");
+  if (file == NULL)
+    return false;
+  std::string position;
+  char buffer[1024];
+  while (fgets(buffer, sizeof buffer, file) != NULL) {
+    if (strspn(buffer, " \t\r\n") == strlen(buffer)) {
+      if (!position.empty())
+        positions->push_back(position);
+      position.clear();
+    } else {
+      position += buffer;
+    }
+  }
+  if (!position.empty())
+    positions->push_back(position);
+  fclose(file);
+  return true;
+}
+
+int EvaluateBatch(
+    const std::vector<std::string>& positions,
+    int num_threads,
+    FILE* output) {
+  assert(num_threads >= 1);
+  Batch batch(positions, output);
+  std::vector<pthread_t> threads(num_threads);
+  for (int i = 0; i < num_threads; ++i) {
+    if (pthread_create(&threads[i], NULL, Batch::Work, &batch) != 0) {
+      fprintf(stderr, "Cannot create background thread\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+  void* ignored;
+  for (int i = 0; i < num_threads; ++i) {
+    if (pthread_join(threads[i], &ignored) != 0) {
+      fprintf(stderr, "Cannot join background thread\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+  return batch.num_valid();
+}
+
+int CountMovesToWin(
+    const Position& position, Player attacker, int max_depth, Cell* move) {
+  volatile int depth = max_depth;
+  Searcher searcher(NULL, &depth, position, attacker);
+  Searcher::SearchForAttacker(&searcher);
+  return searcher.CountMovesToWin(max_depth, move);
+}
+
+}  // namespace SIZED_NAMESPACE
 }  // namespace lajkonik
@@ -27,12 +27,14 @@
 // Declaration of the game engine.
 
 #include <pthread.h>
+#include <stdio.h>
 #include <string>
 #include <vector>
 
 #include "havannah.h"
 
 namespace lajkonik {
+namespace SIZED_NAMESPACE {
 
 enum {
   kNoneWon,
@@ -79,6 +81,34 @@ class Engine {
   void operator=(const Engine&);
 };
 
+// Returns true if the description is a board rather than a list of moves.
+// Moves are a letter and digits, so they never contain '.', and no move
+// is a lone 'x' or 'o', even on boards with columns x and o.
+bool DescribesBoard(const std::string& description);
+
+// Reads positions separated by blank lines from the file.
+bool ReadBatch(const char* file_name, std::vector<std::string>* positions);
+
+// Evaluates the positions for both players on num_threads threads,
+// each owning its Position. A position is either a board in the format
+// of Position::ParseString() or a list of moves starting with white.
+// Writes the line "<n> <white evaluation> <black evaluation>" or "<n> ?"
+// for invalid positions to output as soon as the nth position and all
+// before it are done. Returns the number of valid positions.
+int EvaluateBatch(
+    const std::vector<std::string>& positions,
+    int num_threads,
+    FILE* output);
+
+// Searches the position for the attacker on the calling thread,
+// deepening up to max_depth. Returns the number of his moves to the win
+// that the search proves, or 0 if it proves none. Stores the first
+// of them in move.
+int CountMovesToWin(
+    const Position& position, Player attacker, int max_depth, Cell* move);
+
+}  // namespace SIZED_NAMESPACE
+using namespace SIZED_NAMESPACE;
 }  // namespace lajkonik
 
 #endif  // ENGINE_H_
@@ -0,0 +1,80 @@
+#ifndef FRONTEND_H_
+#define FRONTEND_H_
+
+
+// Copyright (c) 2010-2012 Marcin Ciura, Piotr Wieczorek
+//
+// Permission is hereby granted, free of charge, to any person
+// obtaining a copy of this software and associated documentation
+// files (the "Software"), to deal in the Software without
+// restriction, including without limitation the rights to use,
+// copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following
+// conditions:
+//
+// The above copyright notice and this permission notice shall be
+// included in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+// EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+// OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+// NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+// HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+// WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+// OTHER DEALINGS IN THE SOFTWARE.
+
+// The part of the GTP frontend that does not depend on the board size.
+// Each board size linked into the binary registers its own frontend
+// and the boardsize command switches between them.
+
+#include <utility>
+#include <vector>
+
+namespace lajkonik {
+
+// A parser of GTP commands for one board size.
+class FrontendBase {
+ public:
+  virtual ~FrontendBase() {}
+
+  // Executes one command and prints the answer.
+  virtual void HandleCommand(char* command) = 0;
+
+  // Returns the successive command names that start with text,
+  // in the manner of readline's completion generators.
+  virtual char* GenerateCommand(const char* text, int state) = 0;
+
+  // Sets the options of this frontend to the values
+  // of the same options of other.
+  void CopyOptionsFrom(const FrontendBase& other);
+
+ protected:
+  FrontendBase() {}
+
+  // Names and addresses of the options settable by setoption.
+  std::vector<std::pair<const char*, double*> > double_options_;
+  std::vector<std::pair<const char*, int*> > int_options_;
+  std::vector<std::pair<const char*, bool*> > bool_options_;
+
+ private:
+  FrontendBase(const FrontendBase&);
+  void operator=(const FrontendBase&);
+};
+
+// Creates the frontend of a board size.
+typedef FrontendBase* (*FrontendFactory)();
+
+// Makes the board size available in the binary. Called during
+// static initialization of the modules compiled for that size.
+void RegisterFrontend(int side_length, FrontendFactory factory);
+
+// Makes the frontend of the board size handle subsequent commands,
+// creating it if needed and copying the options of the current one.
+// Returns false if the size is not linked into the binary.
+bool SwitchFrontend(int side_length);
+
+}  // namespace lajkonik
+
+#endif  // FRONTEND_H_
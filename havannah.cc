@@ -32,15 +32,16 @@
 #include "havannah.h"
 
 #include <assert.h>
+#include <limits.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
-#include <time.h>
+#include <sys/mman.h>
 #include <functional>
-#include <map>
 #include <utility>
 
 namespace lajkonik {
+namespace SIZED_NAMESPACE {
 namespace {
 
 struct InitModule {
@@ -50,13 +51,30 @@ struct InitModule {
 }  // namespace
 
 const int kNeighborOffsets[3 * 6] = {
-  -1, -32, -31, +1, +32, +31,
-  -33, -63, -30, +33, +63, +30,
-  -2, -64, -62, +2, +64, +62,
+  -1, -kCellsInRow, -kCellsInRow + 1,
+  +1, +kCellsInRow, +kCellsInRow - 1,
+  -kCellsInRow - 1, -2 * kCellsInRow + 1, -kCellsInRow + 2,
+  +kCellsInRow + 1, +2 * kCellsInRow - 1, +kCellsInRow - 2,
+  -2, -2 * kCellsInRow, -2 * kCellsInRow + 2,
+  +2, +2 * kCellsInRow, +2 * kCellsInRow - 2,
+};
+
+// The offsets of the six neighbors of a cell.
+enum {
+  kLeft = -1,
+  kUpLeft = -kCellsInRow,
+  kUpRight = -kCellsInRow + 1,
+  kRight = +1,
+  kDownRight = +kCellsInRow,
+  kDownLeft = +kCellsInRow - 1
 };
 
 const unsigned kReverseNeighborhoods[6] = { 8, 2, 1, 4, 16, 32 };
 
+const int kForkPartitions[3][6] = {
+  { 0, 1, 2, 3, 5, 4 }, { 0, 4, 2, 1, 5, 3 }, { 0, 3, 2, 4, 5, 1 },
+};
+
 bool g_use_lg_coordinates = false;
 
 bool LiesOnBoard(XCoord x, YCoord y) {
@@ -291,6 +309,30 @@ void BoardBitmask::FillWithNeighborMask(
   }
 }
 
+void BoardBitmask::FillWithMaskOrTwiceAdjacent(const BoardBitmask& mask) {
+  // Only the rows of the board are read, since FillWithNeighborMask()
+  // leaves the others unset.
+  RowBitmask prev = 0;
+  RowBitmask curr = mask.Row(kGapAround);
+  for (YCoord y = kGapAround; y < kPastRows; y = NextY(y)) {
+    const RowBitmask next = (y < kLastRow) ? mask.Row(NextY(y)) : 0;
+    // The six neighbors of each cell, in the order of Get6Neighbors().
+    const RowBitmask neighbors[6] = {
+      prev >> 1, prev, curr >> 1, curr << 1, next, next << 1,
+    };
+    // Count the neighbors in all cells of the row at once, saturating at 2.
+    RowBitmask at_least_one = 0;
+    RowBitmask at_least_two = 0;
+    for (int i = 0; i < 6; ++i) {
+      at_least_two |= at_least_one & neighbors[i];
+      at_least_one |= neighbors[i];
+    }
+    rows_[y] = (curr | at_least_two) & Position::GetBoardBitmask().Row(y);
+    prev = curr;
+    curr = next;
+  }
+}
+
 unsigned BoardBitmask::Get6Neighbors(XCoord x, YCoord y) const {
   // For a board fragment
   //    ab
@@ -314,8 +356,8 @@ Cell BoardBitmask::GetSampleStone() const {
   for (YCoord y = kZeroY; y < kBoardHeight; y = NextY(y)) {
     RowBitmask yth_row = Row(y);
     if (yth_row != 0) {
-      for (XCoord x = kZeroX; x < kThirtyTwoX; x = NextX(x)) {
-        if (yth_row & (1 << x)) {
+      for (XCoord x = kZeroX; x < kCellsInRow; x = NextX(x)) {
+        if (yth_row & Bit(x)) {
           return XYToCell(x, y);
         }
       }
@@ -375,7 +417,6 @@ void Chain::ComputeUnion(
       edges_corners_ring_ |
       other.edges_corners_ring_ |
       other.GetRingMask(x, y);
-  result->newer_version_ = PlayerPosition::kNullChain;
 }
 
 void Chain::InitWithStone(XCoord x, YCoord y) {
@@ -384,7 +425,12 @@ void Chain::InitWithStone(XCoord x, YCoord y) {
   stone_mask_.set(x, y);
   num_stones_ = 1;
   edges_corners_ring_ = Position::GetMaskOfEdgesAndCorners(XYToCell(x, y));
-  newer_version_ = PlayerPosition::kNullChain;
+}
+
+void Chain::Clear() {
+  stone_mask_.ZeroBits();
+  num_stones_ = 0;
+  edges_corners_ring_ = 0;
 }
 
 void Chain::InitWithStoneOutsideBoard(XCoord x, YCoord y) {
@@ -393,7 +439,6 @@ void Chain::InitWithStoneOutsideBoard(XCoord x, YCoord y) {
   stone_mask_.set(x, y);
   num_stones_ = 1;
   edges_corners_ring_ = 0;
-  newer_version_ = PlayerPosition::kNullChain;
 }
 
 WinningCondition Chain::IsVictory() {
@@ -409,13 +454,6 @@ void Chain::CopyFrom(const Chain& other) {
   stone_mask_.CopyFrom(other.stone_mask_);
   num_stones_ = other.num_stones_;
   edges_corners_ring_ = other.edges_corners_ring_;
-  newer_version_ = other.newer_version_;
-}
-
-void Chain::SetNewerVersionReversibly(ChainNum nv, Memento* memento) {
-  assert(PlayerPosition::ChainLiesOnBoard(nv));
-  memento->Remember(&newer_version_);
-  newer_version_ = nv;
 }
 
 unsigned Chain::ClosesAnyRing(XCoord x, YCoord y) const {
@@ -455,11 +493,11 @@ unsigned Chain::ClosesAnyRing(XCoord x, YCoord y) const {
   if (mask == 64)
     return kPositiveResult;
   const int xx = x - 2;
-  const int prev2_line = NthRow(PrevY(PrevY(y))) >> xx;
-  const int prev_line = NthRow(PrevY(y)) >> xx;
-  const int this_line = NthRow(y) >> xx;
-  const int next_line = NthRow(NextY(y)) >> xx;
-  const int next2_line = NthRow(NextY(NextY(y))) >> xx;
+  const RowBitmask prev2_line = NthRow(PrevY(PrevY(y))) >> xx;
+  const RowBitmask prev_line = NthRow(PrevY(y)) >> xx;
+  const RowBitmask this_line = NthRow(y) >> xx;
+  const RowBitmask next_line = NthRow(NextY(y)) >> xx;
+  const RowBitmask next2_line = NthRow(NextY(NextY(y))) >> xx;
   if ((mask & 1) && ((prev2_line & 12) == 12) && (prev_line & 2))
     return kPositiveResult;
   if ((mask & 2) && (prev_line & 2) && (this_line & next_line & 1))
@@ -478,11 +516,11 @@ unsigned Chain::ClosesAnyRing(XCoord x, YCoord y) const {
 unsigned Chain::ClosesBenzeneRing(XCoord x, YCoord y) const {
   const unsigned kPositiveResult = (1 << 13);
   const int xx = x - 2;
-  const int prev2_line = NthRow(PrevY(PrevY(y))) >> xx;
-  const int prev_line = NthRow(PrevY(y)) >> xx;
-  const int this_line = NthRow(y) >> xx;
-  const int next_line = NthRow(NextY(y)) >> xx;
-  const int next2_line = NthRow(NextY(NextY(y))) >> xx;
+  const RowBitmask prev2_line = NthRow(PrevY(PrevY(y))) >> xx;
+  const RowBitmask prev_line = NthRow(PrevY(y)) >> xx;
+  const RowBitmask this_line = NthRow(y) >> xx;
+  const RowBitmask next_line = NthRow(NextY(y)) >> xx;
+  const RowBitmask next2_line = NthRow(NextY(NextY(y))) >> xx;
   if (this_line & 2) {
     if (((prev_line & 10) == 10) && ((prev2_line & 12) == 12))
       return kPositiveResult;
@@ -510,18 +548,27 @@ unsigned Chain::GetRingMask(XCoord x, YCoord y) const {
 }
 
 //-- ChainSet ---------------------------------------------------------
-ChainSet::ChainSet() { Reserve(1); }
-ChainSet::~ChainSet() { ShrinkTo(PlayerPosition::kNumSpecialChains); }
+ChainSet::ChainSet()
+    : chains_(new Chain[kChainNumLimit]),
+      newer_versions_(new ChainNum[kChainNumLimit]),
+      size_(0) {
+  AppendChain();
+}
+
+ChainSet::~ChainSet() {
+  delete[] newer_versions_;
+  delete[] chains_;
+}
 
 void ChainSet::AddStoneToChainReversibly(
     XCoord x, YCoord y, ChainNum ch, Memento* memento) {
   assert(ch == NewestVersion(ch));
-  chains_[ch]->AddStoneReversibly(x, y, memento);
+  chains_[ch].AddStoneReversibly(x, y, memento);
 }
 
 void ChainSet::AddStoneToChainFast(XCoord x, YCoord y, ChainNum ch) {
   assert(ch == NewestVersion(ch));
-  chains_[ch]->AddStoneFast(x, y);
+  chains_[ch].AddStoneFast(x, y);
 }
 
 ChainNum ChainSet::MergeChainsReversibly(
@@ -530,15 +577,12 @@ ChainNum ChainSet::MergeChainsReversibly(
   assert(chain2 == NewestVersion(chain2));
   if (chain1 == chain2)
     return chain2;
-  Chain* chain1_p = chains_[chain1];
-  Chain* chain2_p = chains_[chain2];
-  int last_chain = chains_.size();
-  assert(last_chain < kChainNumLimit);
-  Chain* result = allocator_.MakeChain();
-  chains_.push_back(result);
-  chain1_p->ComputeUnion(x, y, *chain2_p, result);
-  chain1_p->SetNewerVersionReversibly(last_chain, memento);
-  chain2_p->SetNewerVersionReversibly(last_chain, memento);
+  const ChainNum last_chain = AppendChain();
+  chains_[chain1].ComputeUnion(x, y, chains_[chain2], &chains_[last_chain]);
+  memento->Remember(&newer_versions_[chain1]);
+  newer_versions_[chain1] = last_chain;
+  memento->Remember(&newer_versions_[chain2]);
+  newer_versions_[chain2] = last_chain;
   return last_chain;
 }
 
@@ -548,74 +592,73 @@ ChainNum ChainSet::MergeChainsFast(
   assert(chain2 == NewestVersion(chain2));
   if (chain1 == chain2)
     return chain2;
-  Chain* chain1_p = chains_[chain1];
-  Chain* chain2_p = chains_[chain2];
-  int last_chain = chains_.size();
-  assert(last_chain < kChainNumLimit);
-  Chain* result = allocator_.MakeChain();
-  chains_.push_back(result);
-  chain1_p->ComputeUnion(x, y, *chain2_p, result);
-  chain1_p->SetNewerVersionFast(last_chain);
-  chain2_p->SetNewerVersionFast(last_chain);
+  const ChainNum last_chain = AppendChain();
+  chains_[chain1].ComputeUnion(x, y, chains_[chain2], &chains_[last_chain]);
+  newer_versions_[chain1] = last_chain;
+  newer_versions_[chain2] = last_chain;
   return last_chain;
 }
 
 ChainNum ChainSet::MakeOneStoneChain(XCoord x, YCoord y) {
-  int last_chain = chains_.size();
-  assert(last_chain < kChainNumLimit);
+  const ChainNum last_chain = AppendChain();
   assert(PlayerPosition::ChainLiesOnBoard(last_chain));
-  Chain* result = allocator_.MakeChain();
-  chains_.push_back(result);
-  result->InitWithStone(x, y);
+  chains_[last_chain].InitWithStone(x, y);
   return last_chain;
 }
 
-ChainNum ChainSet::push_back(Chain* chain) {
-  int chain_num = chains_.size();
-  chains_.push_back(chain);
-  return chain_num;
-}
-
 ChainNum ChainSet::PushBackChainOutsideBoard(const Chain* chain) {
-  const int chain_num = push_back(const_cast<Chain*>(chain));
+  const ChainNum chain_num = AppendChain();
   assert(!PlayerPosition::ChainLiesOnBoard(chain_num));
+  if (chain != NULL) {
+    chains_[chain_num].CopyFrom(*chain);
+  } else {
+    chains_[chain_num].Clear();
+  }
   return chain_num;
 }
 
+ChainNum ChainSet::AppendChain() {
+  assert(size_ < kChainNumLimit);
+  newer_versions_[size_] = PlayerPosition::kNullChain;
+  return size_++;
+}
+
 ChainNum ChainSet::NewestVersion(ChainNum ch) const {
   assert(ch != PlayerPosition::kNullChain);
-  while (chains_[ch]->newer_version() != PlayerPosition::kNullChain) {
-    ch = chains_[ch]->newer_version();
+  while (newer_versions_[ch] != PlayerPosition::kNullChain) {
+    ch = newer_versions_[ch];
   }
   return ch;
 }
 
-const Chain* ChainSet::NewestVersion(const Chain* ch) const {
-  assert(ch != NULL);
-  while (ch->newer_version() != PlayerPosition::kNullChain) {
-    ch = chain(ch->newer_version());
+void ChainSet::CopyFrom(const ChainSet& other) {
+  size_ = other.size_;
+  for (int i = 1; i < size_; ++i) {
+    chains_[i].CopyFrom(other.chains_[i]);
   }
-  return ch;
+  memcpy(newer_versions_, other.newer_versions_,
+         size_ * sizeof newer_versions_[0]);
 }
 
-void ChainSet::Reserve(int n) {
-  while (static_cast<int>(chains_.size()) < n) {
-    chains_.push_back(NULL);
+void ChainSet::CompactFrom(const ChainSet& other, ChainNum* renumbering) {
+  size_ = 0;
+  renumbering[0] = AppendChain();
+  for (int i = 1; i < other.size_; ++i) {
+    if (other.newer_versions_[i] == PlayerPosition::kNullChain) {
+      const ChainNum chain_num = AppendChain();
+      chains_[chain_num].CopyFrom(other.chains_[i]);
+      renumbering[i] = chain_num;
+    }
   }
-}
-
-void ChainSet::ShrinkTo(int n) {
-  while (static_cast<int>(chains_.size()) > n) {
-    allocator_.DeleteChain(chains_.back());
-    chains_.pop_back();
+  for (int i = 1; i < other.size_; ++i) {
+    renumbering[i] = renumbering[other.NewestVersion(i)];
   }
 }
 
 int ChainSet::CountChains() const {
   int count = 0;
-  for (int i = 1, n = chains_.size(); i < n; ++i) {
-    const Chain* ch = chain(i);
-    if (ch != NULL && ch->newer_version() == PlayerPosition::kNullChain)
+  for (int i = 1; i < size_; ++i) {
+    if (newer_versions_[i] == PlayerPosition::kNullChain)
       ++count;
   }
   return count;
@@ -701,6 +744,62 @@ void PositionEvaluation::SetToMinimum(
   }
 }
 
+void PositionEvaluation::SetToMinimumWithBridgeFrames(
+    const BfsResult from_corner[6]) {
+  // Frames with zero distance need no special case:
+  // min(f1 + f2, 0) is 0 for every move.
+  int distance[6][6];
+  int baseline = get(kNumMovesOnBoard);
+  for (int i = 0; i < 6; ++i) {
+    for (int j = i + 1; j < 6; ++j) {
+      distance[i][j] = std::max(
+          from_corner[i].GetTwoDistance(Position::GetCornerChain(j)),
+          from_corner[j].GetTwoDistance(Position::GetCornerChain(i)));
+      baseline = std::min(baseline, distance[i][j]);
+    }
+  }
+  for (MoveIndex move = kZerothMove; move < kNumMovesOnBoard;
+       move = NextMove(move)) {
+    const Cell cell = Position::MoveIndexToCell(move);
+    int f[6];
+    for (int i = 0; i < 6; ++i) {
+      f[i] = from_corner[i].get(cell);
+    }
+    int value = get(move);
+    for (int i = 0; i < 6; ++i) {
+      for (int j = i + 1; j < 6; ++j) {
+        value = std::min(value, std::min(f[i] + f[j], distance[i][j]));
+      }
+    }
+    set(move, value);
+  }
+  set(kNumMovesOnBoard, baseline);
+}
+
+void PositionEvaluation::SetToMinimumWithForkFrames(
+    const BfsResult& from_chain,
+    const Chain* chain,
+    const BfsResult from_edge[6]) {
+  int distance[6];
+  for (int j = 0; j < 6; ++j) {
+    distance[j] = std::max(
+        from_chain.GetTwoDistance(Position::GetEdgeChain(j)),
+        from_edge[j].GetTwoDistance(chain));
+  }
+  for (MoveIndex move = kZerothMove; move < kNumMovesOnBoard;
+       move = NextMove(move)) {
+    const Cell cell = Position::MoveIndexToCell(move);
+    const int f = from_chain.get(cell);
+    int o[6];
+    for (int j = 0; j < 6; ++j) {
+      o[j] = std::min(f + from_edge[j].get(cell), distance[j]);
+    }
+    set(move, std::min(get(move), ShortestForkFrame(o)));
+  }
+  set(kNumMovesOnBoard,
+      std::min(get(kNumMovesOnBoard), ShortestForkFrame(distance)));
+}
+
 std::string PositionEvaluation::MakeString(const Position* position) const {
   if (g_use_lg_coordinates)
     return MakeLittleGolemString(position);
@@ -849,6 +948,8 @@ PlayerPosition::PlayerPosition() {
   memset(chains_for_cells_, 0, sizeof chains_for_cells_);
   stone_mask_.ZeroBits();
   two_bridge_mask_.ZeroCounters();
+  winning_cells_.ZeroBits();
+  memset(neighborhoods_, 0, sizeof neighborhoods_);
 }
 
 WinningCondition PlayerPosition::MakeMoveReversibly(
@@ -883,6 +984,7 @@ WinningCondition PlayerPosition::MakeMoveReversibly(
   modified_chain_ = chains_for_cells_[cell];
   memento->Remember(&stone_mask_.Row(y));
   stone_mask_.set(x, y);
+  AddStoneToNeighborhoodsReversibly(cell, memento);
   return chain_set_.IsVictory(chain_for_cell(cell));
 }
 
@@ -914,6 +1016,7 @@ WinningCondition PlayerPosition::MakeMoveFast(Cell cell) {
     chains_for_cells_[cell] = chain_set_.MakeOneStoneChain(x, y);
   modified_chain_ = chains_for_cells_[cell];
   stone_mask_.set(x, y);
+  AddStoneToNeighborhoodsFast(cell);
   return chain_set_.IsVictory(chain_for_cell(cell));
 }
 
@@ -928,207 +1031,345 @@ void PlayerPosition::AddChainOutsideBoard(const Chain* chain) {
   }
 }
 
-void PlayerPosition::CreateTwoBridgesAfterOurMoveReversibly(
-    Cell cell, const PlayerPosition& opponent, Memento* memento) {
-// Player creates his own two-bridge.
-#define SET_CELL(acell, a, b) \
-  do { \
-    const Cell bcell = OffsetCell(cell, (b)); \
-    if (CellIsEmpty(bcell) && opponent.CellIsEmpty(bcell) && \
-        StoneIsInCell(OffsetCell(cell, (a) + (b)))) { \
-      memento->Remember(&two_bridge_mask_.get(acell)); \
-      memento->Remember(&two_bridge_mask_.get(bcell)); \
-      two_bridge_mask_.increment(acell); \
-      two_bridge_mask_.increment(bcell); \
-      DUMP(printf("Setting %s %s\n", \
-                  ToString(acell).c_str(), ToString(bcell).c_str())); \
-      ring_db_.AddTwoBridgeReversibly( \
-          acell, bcell, \
-          NewestChainForCell(cell), \
-          NewestChainForCell(OffsetCell(cell, (a) + (b))), \
-          memento); \
-    } \
-  } while (false)
+namespace {
 
-  assert(StoneIsInCell(cell));
-  Cell acell;
-  acell = OffsetCell(cell, -31);
-  if (CellIsEmpty(acell) && opponent.CellIsEmpty(acell)) {
-    SET_CELL(acell, -31, -32);
-    SET_CELL(acell, -31, +1);
-  }
-  acell = OffsetCell(cell, +32);
-  if (CellIsEmpty(acell) && opponent.CellIsEmpty(acell)) {
-    SET_CELL(acell, +32, +1);
-    SET_CELL(acell, +32, +31);
-  }
-  acell = OffsetCell(cell, -1);
-  if (CellIsEmpty(acell) && opponent.CellIsEmpty(acell)) {
-    SET_CELL(acell, -1, -32);
-    SET_CELL(acell, -1, +31);
+// The offsets (dx, dy) of the six neighbors of a cell in clockwise order.
+// Neighbors i and (i + 1) % 6 are adjacent to each other.
+const int kClockwiseNeighbors[6][2] = {
+  { 0, -1 }, { +1, -1 }, { +1, 0 }, { 0, +1 }, { -1, +1 }, { -1, 0 },
+};
+
+// The offsets (dx, dy) of the cells that make a two-bridge with a cell
+// on its neighbors i and (i + 1) % 6.
+const int kClockwiseBridges[6][2] = {
+  { +1, -2 }, { +2, -1 }, { +1, +1 }, { -1, +2 }, { -2, +1 }, { -1, -1 },
+};
+
+// For a board fragment
+//    abc
+//   defg
+//  hijkl
+//  mnop
+//  qrs
+// the 18 neighbors of j correspond to the bit pattern cbagfedlkihponmsrq
+// of PlayerPosition::Get18Neighbors(). A stone is the ith bit of the
+// neighborhood of the cell at the ith of these offsets (dx, dy) from it.
+const int kNeighborhoodOffsets[18][2] = {
+  { +2, -2 }, { +1, -2 }, { 0, -2 },
+  { +2, -1 }, { +1, -1 }, { 0, -1 }, { -1, -1 },
+  { +2, 0 }, { +1, 0 }, { -1, 0 }, { -2, 0 },
+  { +1, +1 }, { 0, +1 }, { -1, +1 }, { -2, +1 },
+  { 0, +2 }, { -1, +2 }, { -2, +2 },
+};
+
+// Returns the cell at offset (dx, dy) from cell.
+Cell OffsetCell(Cell cell, const int offset[2]) {
+  return OffsetCell(cell, offset[0] + kCellsInRow * offset[1]);
+}
+
+// Returns a 6-bit mask whose ith bit is set if the ith neighbor of cell
+// (x, y) from kClockwiseNeighbors is set in the rows above, at and below it.
+unsigned GetClockwiseNeighbors(
+    RowBitmask prev, RowBitmask curr, RowBitmask next, XCoord x) {
+  const unsigned up = static_cast<unsigned>(prev >> x) & 3;
+  const unsigned level = static_cast<unsigned>(curr >> (x - 1)) & 5;
+  const unsigned down = static_cast<unsigned>(next >> (x - 1)) & 3;
+  return up | (level & 4) | ((down & 2) << 2) | ((down & 1) << 4) |
+      ((level & 1) << 5);
+}
+
+// Returns a 6-bit mask whose ith bit is set if mask contains the cell
+// at kClockwiseBridges[i] from the cell at coordinates (x, y).
+unsigned GetClockwiseBridges(const BoardBitmask& mask, XCoord x, YCoord y) {
+  const unsigned top =
+      static_cast<unsigned>(mask.Row(PrevY(PrevY(y))) >> (x + 1)) & 1;
+  const unsigned up = static_cast<unsigned>(mask.Row(PrevY(y)) >> (x - 1)) & 9;
+  const unsigned down =
+      static_cast<unsigned>(mask.Row(NextY(y)) >> (x - 2)) & 9;
+  const unsigned bottom =
+      static_cast<unsigned>(mask.Row(NextY(NextY(y))) >> (x - 1)) & 1;
+  return top | ((up & 8) >> 2) | ((down & 8) >> 1) | (bottom << 3) |
+      ((down & 1) << 4) | ((up & 1) << 5);
+}
+
+// Turns a 6-bit clockwise mask so that bit i takes the value of bit i + 1
+// or of bit i - 1 (mod 6).
+unsigned NextNeighbors(unsigned mask) {
+  return ((mask >> 1) | (mask << 5)) & 63;
+}
+unsigned PrevNeighbors(unsigned mask) {
+  return ((mask << 1) | (mask >> 5)) & 63;
+}
+
+// Returns the row y of mask moved by offset (dx, dy), so that bit x
+// of the result is bit x + dx of row y + dy of mask.
+RowBitmask GetShiftedRow(
+    const BoardBitmask& mask, YCoord y, const int offset[2]) {
+  const RowBitmask row = mask.Row(static_cast<YCoord>(y + offset[1]));
+  return (offset[0] >= 0) ? (row >> offset[0]) : (row << -offset[0]);
+}
+
+}  // namespace
+
+void PlayerPosition::AddStoneToNeighborhoodsReversibly(
+    Cell cell, Memento* memento) {
+  for (int i = 0; i < 18; ++i) {
+    unsigned* neighborhood =
+        &neighborhoods_[OffsetCell(cell, kNeighborhoodOffsets[i])];
+    memento->Remember(neighborhood);
+    *neighborhood |= 1U << i;
   }
-#undef SET_CELL
 }
 
-void PlayerPosition::CreateTwoBridgesAfterOurMoveFast(
-    Cell cell, const PlayerPosition& opponent) {
-// Player creates his own two-bridge.
-#define SET_CELL(acell, a, b) \
-  do { \
-    const Cell bcell = OffsetCell(cell, (b)); \
-    if (CellIsEmpty(bcell) && opponent.CellIsEmpty(bcell) && \
-        StoneIsInCell(OffsetCell(cell, (a) + (b)))) { \
-      two_bridge_mask_.increment(acell); \
-      two_bridge_mask_.increment(bcell); \
-      ring_db_.AddTwoBridgeFast( \
-          acell, bcell, \
-          NewestChainForCell(cell), \
-          NewestChainForCell(OffsetCell(cell, (a) + (b)))); \
-    } \
-  } while (false)
+void PlayerPosition::AddStoneToNeighborhoodsFast(Cell cell) {
+  for (int i = 0; i < 18; ++i)
+    neighborhoods_[OffsetCell(cell, kNeighborhoodOffsets[i])] |= 1U << i;
+}
 
+unsigned PlayerPosition::GetNewTwoBridges(
+    Cell cell, const PlayerPosition& opponent) const {
   assert(StoneIsInCell(cell));
-  Cell acell;
-  acell = OffsetCell(cell, -31);
-  if (CellIsEmpty(acell) && opponent.CellIsEmpty(acell)) {
-    SET_CELL(acell, -31, -32);
-    SET_CELL(acell, -31, +1);
-  }
-  acell = OffsetCell(cell, +32);
-  if (CellIsEmpty(acell) && opponent.CellIsEmpty(acell)) {
-    SET_CELL(acell, +32, +1);
-    SET_CELL(acell, +32, +31);
+  const XCoord x = CellToX(cell);
+  const YCoord y = CellToY(cell);
+  const unsigned partners = GetClockwiseBridges(stone_mask_, x, y);
+  if (partners == 0)
+    return 0;
+  RowBitmask empty[3];
+  for (int i = 0; i < 3; ++i) {
+    const YCoord yy = static_cast<YCoord>(y + i - 1);
+    empty[i] = Position::GetBoardBitmask().Row(yy) &
+        ~stone_mask_.Row(yy) & ~opponent.stone_mask_.Row(yy);
   }
-  acell = OffsetCell(cell, -1);
-  if (CellIsEmpty(acell) && opponent.CellIsEmpty(acell)) {
-    SET_CELL(acell, -1, -32);
-    SET_CELL(acell, -1, +31);
+  const unsigned neighbors =
+      GetClockwiseNeighbors(empty[0], empty[1], empty[2], x);
+  return neighbors & NextNeighbors(neighbors) & partners;
+}
+
+void PlayerPosition::CreateTwoBridgesAfterOurMoveReversibly(
+    Cell cell, const PlayerPosition& opponent, Memento* memento) {
+  // Player creates his own two-bridges.
+  for (unsigned bridges = GetNewTwoBridges(cell, opponent);
+       bridges != 0; bridges &= bridges - 1) {
+    const int i = CountTrailingZeroes(bridges);
+    const Cell acell = OffsetCell(cell, kClockwiseNeighbors[i]);
+    const Cell bcell = OffsetCell(cell, kClockwiseNeighbors[(i + 1) % 6]);
+    memento->Remember(&two_bridge_mask_.get(acell));
+    memento->Remember(&two_bridge_mask_.get(bcell));
+    two_bridge_mask_.increment(acell);
+    two_bridge_mask_.increment(bcell);
+    DUMP(printf("Setting %s %s\n",
+                ToString(acell).c_str(), ToString(bcell).c_str()));
+    ring_db_.AddTwoBridgeReversibly(
+        acell, bcell,
+        NewestChainForCell(cell),
+        NewestChainForCell(OffsetCell(cell, kClockwiseBridges[i])),
+        memento);
   }
-#undef SET_CELL
+}
+
+void PlayerPosition::CreateTwoBridgesAfterOurMoveFast(
+    Cell cell, const PlayerPosition& opponent) {
+  // Player creates his own two-bridges.
+  for (unsigned bridges = GetNewTwoBridges(cell, opponent);
+       bridges != 0; bridges &= bridges - 1) {
+    const int i = CountTrailingZeroes(bridges);
+    const Cell acell = OffsetCell(cell, kClockwiseNeighbors[i]);
+    const Cell bcell = OffsetCell(cell, kClockwiseNeighbors[(i + 1) % 6]);
+    two_bridge_mask_.increment(acell);
+    two_bridge_mask_.increment(bcell);
+    ring_db_.AddTwoBridgeFast(
+        acell, bcell,
+        NewestChainForCell(cell),
+        NewestChainForCell(OffsetCell(cell, kClockwiseBridges[i])));
+  }
+}
+
+unsigned PlayerPosition::GetTwoBridgesThroughCell(Cell cell) const {
+  const YCoord y = CellToY(cell);
+  const unsigned stones = GetClockwiseNeighbors(
+      stone_mask_.Row(PrevY(y)), stone_mask_.Row(y), stone_mask_.Row(NextY(y)),
+      CellToX(cell));
+  return NextNeighbors(stones) & PrevNeighbors(stones);
 }
 
 void PlayerPosition::RemoveTwoBridgesBeforeOurMoveOrAfterFoeMoveReversibly(
     Cell cell, Memento* memento) {
-// Player attacks an opponent's two-bridge.
-#define ZERO_CELL(a, b, c) \
-  do { \
-    ring_db_.RemoveHalfBridgeReversibly( \
-        cell, \
-        NewestChainForCell(OffsetCell(cell, (a))), \
-        NewestChainForCell(OffsetCell(cell, (b))), \
-        memento); \
-    const Cell ccell = OffsetCell(cell, (c)); \
-    if (two_bridge_mask_.get(ccell) != 0) { \
-      memento->Remember(&two_bridge_mask_.get(ccell)); \
-      two_bridge_mask_.decrement(ccell); \
-      DUMP(printf("Clearing %s -> %d\n", \
-                  ToString(ccell).c_str(), two_bridge_mask_.get(ccell))); \
-      if (two_bridge_mask_.get(ccell) == 0) { \
-        ring_db_.RemoveHalfBridgeReversibly( \
-            ccell, \
-            NewestChainForCell(OffsetCell(cell, (a))), \
-            NewestChainForCell(OffsetCell(cell, (b))), \
-            memento); \
-      } \
-    } \
-  } while (false)
-
+  // Player attacks an opponent's two-bridges. Bit i of bridges is set
+  // for the two-bridge between neighbors i - 1 and i + 1 of cell.
   assert(CellIsEmpty(cell));
-  if (two_bridge_mask_.get(cell) != 0) {
-    memento->Remember(&two_bridge_mask_.get(cell));
-    two_bridge_mask_.zero(cell);
-
-    if (StoneIsInCell(OffsetCell(cell, -31))) {
-      if (StoneIsInCell(OffsetCell(cell, -1)))
-        ZERO_CELL(-31, -1, -32);
-      if (StoneIsInCell(OffsetCell(cell, +32)))
-        ZERO_CELL(-31, +32, +1);
-    }
-    if (StoneIsInCell(OffsetCell(cell, +1))) {
-      if (StoneIsInCell(OffsetCell(cell, -32)))
-        ZERO_CELL(+1, -32, -31);
-      if (StoneIsInCell(OffsetCell(cell, +31)))
-        ZERO_CELL(+1, +31, +32);
+  if (two_bridge_mask_.get(cell) == 0)
+    return;
+  memento->Remember(&two_bridge_mask_.get(cell));
+  two_bridge_mask_.zero(cell);
+  for (unsigned bridges = GetTwoBridgesThroughCell(cell);
+       bridges != 0; bridges &= bridges - 1) {
+    const int i = CountTrailingZeroes(bridges);
+    const ChainNum chain0 = NewestChainForCell(
+        OffsetCell(cell, kClockwiseNeighbors[(i + 5) % 6]));
+    const ChainNum chain1 = NewestChainForCell(
+        OffsetCell(cell, kClockwiseNeighbors[(i + 1) % 6]));
+    ring_db_.RemoveHalfBridgeReversibly(cell, chain0, chain1, memento);
+    const Cell ccell = OffsetCell(cell, kClockwiseNeighbors[i]);
+    if (two_bridge_mask_.get(ccell) != 0) {
+      memento->Remember(&two_bridge_mask_.get(ccell));
+      two_bridge_mask_.decrement(ccell);
+      DUMP(printf("Clearing %s -> %d\n",
+                  ToString(ccell).c_str(), two_bridge_mask_.get(ccell)));
+      if (two_bridge_mask_.get(ccell) == 0)
+        ring_db_.RemoveHalfBridgeReversibly(ccell, chain0, chain1, memento);
     }
-    if ((StoneIsInCell(OffsetCell(cell, -32))) &&
-        (StoneIsInCell(OffsetCell(cell, +31))))
-      ZERO_CELL(-32, +31, -1);
-    if ((StoneIsInCell(OffsetCell(cell, -1))) &&
-        (StoneIsInCell(OffsetCell(cell, +32))))
-      ZERO_CELL(-1, +32, +31);
   }
-#undef ZERO_CELL
 }
 
 void PlayerPosition::RemoveTwoBridgesBeforeOurMoveOrAfterFoeMoveFast(
     Cell cell) {
-// Player attacks an opponent's two-bridge.
-#define ZERO_CELL(a, b, c) \
-  do { \
-    ring_db_.RemoveHalfBridgeFast( \
-        cell, \
-        NewestChainForCell(OffsetCell(cell, (a))), \
-        NewestChainForCell(OffsetCell(cell, (b)))); \
-    const Cell ccell = OffsetCell(cell, (c)); \
-    if (two_bridge_mask_.get(ccell) != 0) { \
-      two_bridge_mask_.decrement(ccell); \
-      if (two_bridge_mask_.get(ccell) == 0) { \
-        ring_db_.RemoveHalfBridgeFast( \
-            ccell, \
-            NewestChainForCell(OffsetCell(cell, (a))), \
-            NewestChainForCell(OffsetCell(cell, (b)))); \
-      } \
-    } \
-  } while (false)
-
+  // Player attacks an opponent's two-bridges.
   assert(CellIsEmpty(cell));
-  if (two_bridge_mask_.get(cell) != 0) {
-    two_bridge_mask_.zero(cell);
+  if (two_bridge_mask_.get(cell) == 0)
+    return;
+  two_bridge_mask_.zero(cell);
+  for (unsigned bridges = GetTwoBridgesThroughCell(cell);
+       bridges != 0; bridges &= bridges - 1) {
+    const int i = CountTrailingZeroes(bridges);
+    const ChainNum chain0 = NewestChainForCell(
+        OffsetCell(cell, kClockwiseNeighbors[(i + 5) % 6]));
+    const ChainNum chain1 = NewestChainForCell(
+        OffsetCell(cell, kClockwiseNeighbors[(i + 1) % 6]));
+    ring_db_.RemoveHalfBridgeFast(cell, chain0, chain1);
+    const Cell ccell = OffsetCell(cell, kClockwiseNeighbors[i]);
+    if (two_bridge_mask_.get(ccell) != 0) {
+      two_bridge_mask_.decrement(ccell);
+      if (two_bridge_mask_.get(ccell) == 0)
+        ring_db_.RemoveHalfBridgeFast(ccell, chain0, chain1);
+    }
+  }
+}
 
-    if (StoneIsInCell(OffsetCell(cell, -31))) {
-      if (StoneIsInCell(OffsetCell(cell, -1)))
-        ZERO_CELL(-31, -1, -32);
-      if (StoneIsInCell(OffsetCell(cell, +32)))
-        ZERO_CELL(-31, +32, +1);
+void PlayerPosition::CountTwoBridges(
+    const PlayerPosition& opponent, BoardCounter* counter) const {
+  counter->ZeroCounters();
+  BoardBitmask empty;
+  empty.ZeroBits();
+  for (YCoord y = kGapAround; y < kPastRows; y = NextY(y)) {
+    empty.Row(y) = Position::GetBoardBitmask().Row(y) &
+        ~stone_mask_.Row(y) & ~opponent.stone_mask_.Row(y);
+  }
+  // Directions 0, 1 and 2 cover each two-bridge once.
+  for (int i = 0; i < 3; ++i) {
+    const int* const a = kClockwiseNeighbors[i];
+    const int* const b = kClockwiseNeighbors[i + 1];
+    for (YCoord y = kGapAround; y < kPastRows; y = NextY(y)) {
+      RowBitmask bridges = stone_mask_.Row(y) &
+          GetShiftedRow(stone_mask_, y, kClockwiseBridges[i]) &
+          GetShiftedRow(empty, y, a) & GetShiftedRow(empty, y, b);
+      while (bridges != 0) {
+        const Cell cell = XYToCell(
+            static_cast<XCoord>(CountTrailingZeroes(bridges)), y);
+        counter->increment(OffsetCell(cell, a));
+        counter->increment(OffsetCell(cell, b));
+        bridges &= bridges - 1;
+      }
     }
-    if (StoneIsInCell(OffsetCell(cell, +1))) {
-      if (StoneIsInCell(OffsetCell(cell, -32)))
-        ZERO_CELL(+1, -32, -31);
-      if (StoneIsInCell(OffsetCell(cell, +31)))
-        ZERO_CELL(+1, +31, +32);
+  }
+}
+
+void PlayerPosition::UpdateWinningCellsAfterOurMoveReversibly(
+    Cell cell, const PlayerPosition& opponent, bool only_nearby,
+    Memento* memento) {
+  assert(StoneIsInCell(cell));
+  const Chain* chain =
+      chain_set_.chain(chain_set_.NewestVersion(modified_chain_));
+  const XCoord cell_x = CellToX(cell);
+  const YCoord cell_y = CellToY(cell);
+  YCoord first_y = kGapAround;
+  YCoord last_y = kLastRow;
+  if (only_nearby) {
+    // Chain::ClosesAnyRing() looks at most two cells away, and the cells
+    // farther than one cell away from the stone keep their edges and
+    // corners, so only the rings of the chain can make them win.
+    first_y = std::max(static_cast<YCoord>(cell_y - 2), first_y);
+    last_y = std::min(static_cast<YCoord>(cell_y + 2), last_y);
+  }
+  for (YCoord y = first_y; y <= last_y; y = NextY(y)) {
+    const RowBitmask prev = chain->NthRow(PrevY(y));
+    const RowBitmask curr = chain->NthRow(y);
+    const RowBitmask next = chain->NthRow(NextY(y));
+    // More stones never spoil a win, so the cells that already win stay.
+    RowBitmask winning = winning_cells_.Row(y);
+    if (y == cell_y)
+      winning &= ~BoardBitmask::Bit(cell_x);
+    // The empty cells next to the chain.
+    RowBitmask liberties =
+        (prev | (prev >> 1) | (curr >> 1) | (curr << 1) | next | (next << 1)) &
+        Position::GetBoardBitmask().Row(y) &
+        ~stone_mask_.Row(y) & ~opponent.stone_mask_.Row(y) & ~winning;
+    // The neighbors of the stone, which need all the tests.
+    RowBitmask full_tests = ~static_cast<RowBitmask>(0);
+    if (only_nearby) {
+      liberties &=
+          BoardBitmask::Bit(static_cast<XCoord>(cell_x + 3)) -
+          BoardBitmask::Bit(static_cast<XCoord>(cell_x - 2));
+      full_tests =
+          (BoardBitmask::Bit(static_cast<XCoord>(cell_x + 2)) -
+           BoardBitmask::Bit(static_cast<XCoord>(cell_x - 1))) &
+          ~BoardBitmask::Bit(static_cast<XCoord>(cell_x + y - cell_y));
+      if (y < cell_y - 1 || y > cell_y + 1)
+        full_tests = 0;
+    }
+    while (liberties != 0) {
+      const XCoord x = static_cast<XCoord>(CountTrailingZeroes(liberties));
+      if ((full_tests & BoardBitmask::Bit(x)) ?
+          MoveWouldWin(XYToCell(x, y)) : chain->ClosesAnyRing(x, y)) {
+        winning |= BoardBitmask::Bit(x);
+      }
+      liberties &= liberties - 1;
+    }
+    if (winning != winning_cells_.Row(y)) {
+      memento->Remember(&winning_cells_.Row(y));
+      winning_cells_.Row(y) = winning;
     }
-    if ((StoneIsInCell(OffsetCell(cell, -32))) &&
-        (StoneIsInCell(OffsetCell(cell, +31))))
-      ZERO_CELL(-32, +31, -1);
-    if ((StoneIsInCell(OffsetCell(cell, -1))) &&
-        (StoneIsInCell(OffsetCell(cell, +32))))
-      ZERO_CELL(-1, +32, +31);
   }
-#undef ZERO_CELL
 }
 
-unsigned PlayerPosition::Get18Neighbors(Cell cell) const {
+bool PlayerPosition::MoveWouldOnlyExtendOneChain(Cell cell) const {
+  assert(CellIsEmpty(cell));
+  ChainNum extended = kNullChain;
+  for (int i = 0; i < 6; ++i) {
+    ChainNum chain = chain_for_cell(NthNeighbor(cell, i));
+    if (ChainLiesOnBoard(chain)) {
+      chain = chain_set_.NewestVersion(chain);
+      if (extended != kNullChain && chain != extended)
+        return false;
+      extended = chain;
+    }
+  }
+  if (extended == kNullChain)
+    return true;
+  return (Position::GetMaskOfEdgesAndCorners(cell) &
+          ~chain_set_.edges_corners_ring(extended)) == 0;
+}
+
+void PlayerPosition::UpdateWinningCellsAfterFoeMoveReversibly(
+    Cell cell, Memento* memento) {
   const XCoord x = CellToX(cell);
   const YCoord y = CellToY(cell);
-  // For a board fragment
-  //    abc
-  //   defg
-  //  hijkl
-  //  mnop
-  //  qrs
-  // the 18 neighbors of j correspond to the bit pattern cbagfedlkihponmsrq.
-  unsigned neighborhood;
-  neighborhood = (stone_mask_.Row(PrevY(PrevY(y))) >> x) & 7;
-  neighborhood = (neighborhood << 4) |
-                 ((stone_mask_.Row(PrevY(y)) >> (x - 1)) & 15);
-  const RowBitmask curr_line = stone_mask_.Row(y);
-  neighborhood = (neighborhood << 2) | ((curr_line >> (x + 1)) & 3);
-  neighborhood = (neighborhood << 2) | ((curr_line >> (x - 2)) & 3);
-  neighborhood = (neighborhood << 4) |
-                 ((stone_mask_.Row(NextY(y)) >> (x - 2)) & 15);
-  neighborhood = (neighborhood << 3) |
-                 ((stone_mask_.Row(NextY(NextY(y))) >> (x - 2)) & 7);
-  return neighborhood;
+  if (winning_cells_.get(x, y)) {
+    memento->Remember(&winning_cells_.Row(y));
+    winning_cells_.clear(x, y);
+  }
+}
+
+bool PlayerPosition::MoveWouldWin(Cell cell) const {
+  assert(CellIsEmpty(cell));
+  const unsigned edges_corners = Position::GetMaskOfEdgesAndCorners(cell);
+  const int neighbor_groups =
+      Position::CountNeighborGroupsWithPossibleBenzeneRings(
+          Get6Neighbors(cell));
+  if (neighbor_groups >= 2)
+    return MoveWouldCloseForkBridgeOrRing(cell, edges_corners, kNullChain);
+  if (neighbor_groups == 1 && edges_corners != 0)
+    return MoveWouldCloseForkOrBridge(cell, edges_corners, kNullChain);
+  return false;
 }
 
 bool PlayerPosition::MoveWouldCloseForkOrBridge(
@@ -1222,41 +1463,29 @@ void PlayerPosition::UpdateChainsToNewestVersionsReversibly(Memento* memento) {
 }
 
 void PlayerPosition::CopyFrom(const PlayerPosition& other) {
-  const int end = other.chain_set_.size();
-  chain_set_.ShrinkTo(1);
-  chain_set_.Reserve(end);
-  for (int i = 1; i < end; ++i) {
-    const Chain* p = other.chain_set_.chain(i);
-    if (p != NULL) {
-      if (p->newer_version() == kNullChain) {
-        Chain* chain = chain_set_.allocator().MakeChain();
-        chain->CopyFrom(*p);
-        chain_set_.set_chain(i, chain);
-      }
-    }
-  }
+  ChainNum renumbering[kChainNumLimit];
+  chain_set_.CompactFrom(other.chain_set_, renumbering);
   for (Cell cell = kZerothCell; cell < kNumCellsWithSentinels;
        cell = NextCell(cell)) {
     const ChainNum chain = other.chain_for_cell(cell);
     if (chain == kNullChain) {
       chains_for_cells_[cell] = 0;
     } else {
-      int newest_version = other.chain_set_.NewestVersion(chain);
-      assert(chain_set_.chain(newest_version) != NULL);
-      assert(chain_set_.chain(newest_version)->newer_version() == kNullChain);
-      chains_for_cells_[cell] = newest_version;
+      chains_for_cells_[cell] = renumbering[chain];
     }
   }
   stone_mask_.CopyFrom(other.stone_mask());
   two_bridge_mask_.CopyFrom(other.two_bridge_mask());
-  ring_db_.CopyFrom(other.ring_db_);
+  winning_cells_.CopyFrom(other.winning_cells());
+  memcpy(neighborhoods_, other.neighborhoods_, sizeof neighborhoods_);
+  ring_db_.CompactFrom(other.ring_db_, other.chain_set_, renumbering);
 }
 
 void PlayerPosition::GetCurrentChains(
     std::set<const Chain*>* current_chains) const {
   for (int i = kNumSpecialChains, size = chain_set_.size(); i < size; ++i) {
-    if (chain_set_.chain(i) != NULL) {
-      current_chains->insert(chain_set_.NewestVersion(chain_set_.chain(i)));
+    if (chain_set_.newer_version(i) == kNullChain) {
+      current_chains->insert(chain_set_.chain(i));
     }
   }
 }
@@ -1409,12 +1638,151 @@ void PlayerPosition::ComputeTwoDistance(
       result, &result_1, &queue);
 }
 
+namespace {
+
+// Sets the cells of result that lie in passable and neighbor cells of mask.
+void FillWithPassableNeighbors(
+    const BoardBitmask& mask,
+    const BoardBitmask& passable,
+    BoardBitmask* result) {
+  for (YCoord y = kGapAround; y < kPastRows; y = NextY(y)) {
+    const RowBitmask prev = mask.Row(PrevY(y));
+    const RowBitmask curr = mask.Row(y);
+    const RowBitmask next = mask.Row(NextY(y));
+    result->Row(y) = passable.Row(y) &
+        (prev | next | ((prev | curr) >> 1) | ((curr | next) << 1));
+  }
+}
+
+}  // namespace
+
+void PlayerPosition::ComputeOneDistancesFromEdges(
+    const PlayerPosition& op,
+    int max_distance,
+    BfsResult result[6]) const {
+  const Chain* edge_chains[6];
+  for (int j = 0; j < 6; ++j) {
+    edge_chains[j] = Position::GetEdgeChain(j);
+  }
+  ComputeOneDistances(edge_chains, op, max_distance, result);
+}
+
+int PlayerPosition::BoundMovesToWin(
+    const PlayerPosition& op, int max_moves) const {
+  if (!winning_cells_.IsZero())
+    return 1;
+  int bound = max_moves + 1;
+  if (bound <= 2)
+    return bound;
+  for (int i = 0, size = ring_frame_count(); i < size; ++i) {
+    const unsigned* frame = ring_frame(i);
+    if (frame != NULL)
+      bound = std::min(bound, std::max(static_cast<int>(frame[0]), 2));
+  }
+  // A winning chain holds paths from each of its cells to the edges
+  // or corners it joins, and every empty cell on them needs a stone.
+  BfsResult from_edge[6];
+  BfsResult from_corner[6];
+  const Chain* corner_chains[6];
+  for (int j = 0; j < 6; ++j) {
+    corner_chains[j] = Position::GetCornerChain(j);
+  }
+  ComputeOneDistancesFromEdges(op, bound - 1, from_edge);
+  ComputeOneDistances(corner_chains, op, bound - 1, from_corner);
+  for (MoveIndex move = kZerothMove; move < kNumMovesOnBoard;
+       move = NextMove(move)) {
+    const Cell cell = Position::MoveIndexToCell(move);
+    const int needs_stone = (CellIsEmpty(cell) ? 1 : 0);
+    int edge[6];
+    int corner[6];
+    for (int j = 0; j < 6; ++j) {
+      edge[j] = from_edge[j].get(cell);
+      corner[j] = from_corner[j].get(cell);
+    }
+    std::nth_element(edge, edge + 2, edge + 6);
+    std::nth_element(corner, corner + 1, corner + 6);
+    bound = std::min(bound, std::min(edge[2], corner[1]) + needs_stone);
+  }
+  return std::max(bound, 2);
+}
+
+void PlayerPosition::ComputeOneDistances(
+    const Chain* const start_chains[6],
+    const PlayerPosition& op,
+    int max_distance,
+    BfsResult result[6]) const {
+  assert(max_distance < BfsResult::kMaxDistance);
+  // Virtual chains are blocked, like in Bfs2(), so no path runs along
+  // another edge; the virtual stones of the start chain are only the
+  // sources of the search.
+  BoardBitmask passable;
+  passable.ZeroBits();
+  for (YCoord y = kGapAround; y < kPastRows; y = NextY(y)) {
+    passable.Row(y) =
+        Position::GetBoardBitmask().Row(y) & ~op.stone_mask().Row(y);
+  }
+  // The cells reached so far, the cells reached at the current distance,
+  // and the Chains among them with their neighbors.
+  BoardBitmask reached;
+  BoardBitmask frontier;
+  BoardBitmask chains;
+  BoardBitmask neighbors;
+  frontier.ZeroBits();
+  neighbors.ZeroBits();
+  for (int j = 0; j < 6; ++j) {
+    result[j].SetAllTo(max_distance + 1);
+    reached.ZeroBits();
+    FillWithPassableNeighbors(
+        start_chains[j]->stone_mask(), passable, &frontier);
+    for (int distance = 0; ; ++distance) {
+      // Own stones are free to pass, so a stone brings in its whole Chain
+      // and the neighbors of the Chain at the same distance.
+      chains.ZeroBits();
+      bool any_chains = false;
+      for (YCoord y = kGapAround; y < kPastRows; y = NextY(y)) {
+        RowBitmask stones =
+            frontier.Row(y) & ~reached.Row(y) & stone_mask().Row(y);
+        while (stones != 0) {
+          const XCoord x = static_cast<XCoord>(CountTrailingZeroes(stones));
+          const Chain* chain = NthChain(NewestChainForCell(XYToCell(x, y)));
+          chains.FillWithOr(chains, chain->stone_mask());
+          any_chains = true;
+          stones &= ~chains.Row(y);
+        }
+      }
+      if (any_chains) {
+        FillWithPassableNeighbors(chains, passable, &neighbors);
+        for (YCoord y = kGapAround; y < kPastRows; y = NextY(y)) {
+          frontier.Row(y) |=
+              neighbors.Row(y) | (chains.Row(y) & passable.Row(y));
+        }
+      }
+      bool any_cells = false;
+      for (YCoord y = kGapAround; y < kPastRows; y = NextY(y)) {
+        RowBitmask cells = frontier.Row(y) & ~reached.Row(y);
+        frontier.Row(y) = cells;
+        reached.Row(y) |= cells;
+        any_cells |= (cells != 0);
+        while (cells != 0) {
+          const XCoord x = static_cast<XCoord>(CountTrailingZeroes(cells));
+          result[j].set(XYToCell(x, y), distance);
+          cells &= cells - 1;
+        }
+      }
+      if (!any_cells || distance == max_distance)
+        break;
+      // Leaving an empty cell costs one. The neighbors of own stones
+      // in the frontier are already reached.
+      FillWithPassableNeighbors(frontier, passable, &neighbors);
+      frontier.CopyFrom(neighbors);
+    }
+  }
+}
+
 //-- Position ---------------------------------------------------------
 uint64 Position::kEdgesCornersNeighbors[kNumCellsWithSentinels];
-Cell Position::kConstMoveIndexToCell[kNumMovesOnBoard];
 Cell Position::kMoveIndexToCell[kNumMovesOnBoard];
 Cell Position::kNeighbors[kNumCellsWithSentinels][8];
-MoveIndex Position::kConstCellToMoveIndex[kNumCellsWithSentinels];
 MoveIndex Position::kCellToMoveIndex[kNumCellsWithSentinels];
 Hash Position::kZobristHash[kNumMovesOnBoard][2];
 BoardBitmask Position::kIsCellOnBoardBitmask;
@@ -1422,6 +1790,7 @@ BoardBitmask Position::kIsVirtualEdge;
 BoardBitmask Position::kIsVirtualCorner;
 Chain Position::kEdgeChains[6];
 Chain Position::kCornerChains[6];
+bool Position::kIsDeadCellPattern[1 << 12];
 // The zero at position 63 is important for RingDB::VerifyCycle.
 const unsigned char Position::kGroupCount[64] = {
   0, 1, 1, 1, 1, 1, 2, 1, 1, 2, 1, 1, 2, 2, 2, 1,
@@ -1439,7 +1808,7 @@ const unsigned char Position::kGroupCountWithPossibleBenzeneRings[64] = {
 void Position::InitStaticFields() {
   MoveIndex move = kZerothMove;
   for (YCoord y = kZeroY; y < kBoardHeight; y = NextY(y)) {
-    for (XCoord x = kZeroX; x < kThirtyTwoX; x = NextX(x)) {
+    for (XCoord x = kZeroX; x < kCellsInRow; x = NextX(x)) {
       uint64 mask = 0ULL;
       if (LiesOnBoard(x, y)) {
         // Set up the mask of edges.
@@ -1482,13 +1851,13 @@ void Position::InitStaticFields() {
             mask = (64u << 4) | ((65 * 0x2A) << 16);
         }
         const Cell cell = XYToCell(x, y);
-        kConstMoveIndexToCell[move] = cell;
-        kConstCellToMoveIndex[cell] = move;
+        kMoveIndexToCell[move] = cell;
+        kCellToMoveIndex[cell] = move;
         move = NextMove(move);
         kIsCellOnBoardBitmask.set(x, y);
       } else {
         const Cell cell = XYToCell(x, y);
-        kConstCellToMoveIndex[cell] = kInvalidMove;
+        kCellToMoveIndex[cell] = kInvalidMove;
         kIsCellOnBoardBitmask.clear(x, y);
       }
       // Add the mask of 18-neighbors.
@@ -1573,14 +1942,34 @@ void Position::InitStaticFields() {
     }
   }
 
-  srand48(time(NULL));
+  // Cells outside the board appear in both halves of the pattern.
+  // A stone with no empty neighbors can only gain something by joining
+  // two chains, by closing a ring (possibly a benzene one, through
+  // three adjacent neighbors), or by touching an edge or corner.
+  for (unsigned pattern = 0; pattern < ARRAYSIZE(kIsDeadCellPattern);
+       ++pattern) {
+    const unsigned player_cells = pattern & 63;
+    const unsigned opponent_cells = pattern >> 6;
+    const unsigned outside_cells = player_cells & opponent_cells;
+    const unsigned player_stones = player_cells & ~outside_cells;
+    kIsDeadCellPattern[pattern] =
+        ((player_cells | opponent_cells) == 63 &&
+         (player_stones == 0 ||
+          (outside_cells == 0 &&
+           CountNeighborGroupsWithPossibleBenzeneRings(player_stones) <= 1)));
+  }
+
+  // A fixed seed gives the same hashes in every process, which makes
+  // searches reproducible. The generator keeps its state in seed instead
+  // of the global state of srand48().
+  unsigned short seed[3] = { 0x330E, 0x1234, 0xABCD };
   for (MoveIndex mv = kZerothMove; mv < ARRAYSIZE(kZobristHash);
        mv = NextMove(mv)) {
     // Two consecutive XorShifts would not be linearly independent enough.
     // They cause hash collisions, manifesting in Lajkonik trying to move
     // into already occupied cells.
-    kZobristHash[mv][kWhite] = (1ULL << 32) * mrand48() + mrand48();
-    kZobristHash[mv][kBlack] = (1ULL << 32) * mrand48() + mrand48();
+    kZobristHash[mv][kWhite] = (1ULL << 32) * jrand48(seed) + jrand48(seed);
+    kZobristHash[mv][kBlack] = (1ULL << 32) * jrand48(seed) + jrand48(seed);
   }
 }
 
@@ -1597,17 +1986,14 @@ void Position::InitToStartPosition() {
     player_positions_[kBlack].AddChainOutsideBoard(GetEdgeChain(i));
     player_positions_[kBlack].AddChainOutsideBoard(GetCornerChain(i));
   }
+  memcpy(available_cells_, kMoveIndexToCell, sizeof available_cells_);
   num_available_moves_ = kNumMovesOnBoard;
   for (YCoord y = kZeroY; y < kBoardHeight; y = NextY(y)) {
-    for (XCoord x = kZeroX; x < kThirtyTwoX; x = NextX(x)) {
+    for (XCoord x = kZeroX; x < kCellsInRow; x = NextX(x)) {
       Cell cell = XYToCell(x, y);
       cells_[cell] = LiesOnBoard(x, y) ? 0 : 3;
     }
   }
-  assert(sizeof kMoveIndexToCell == sizeof kConstMoveIndexToCell);
-  memcpy(kMoveIndexToCell, kConstMoveIndexToCell, sizeof kMoveIndexToCell);
-  assert(sizeof kCellToMoveIndex == sizeof kConstCellToMoveIndex);
-  memcpy(kCellToMoveIndex, kConstCellToMoveIndex, sizeof kCellToMoveIndex);
   is_initialized_ = true;
 }
 
@@ -1617,6 +2003,7 @@ void Position::CopyFrom(const Position& other) {
   player_positions_[kBlack].CopyFrom(other.player_positions_[kBlack]);
   memcpy(cells_, other.cells_, sizeof cells_);
   move_count_ = other.move_count_;
+  memcpy(available_cells_, other.available_cells_, sizeof available_cells_);
   num_available_moves_ = other.num_available_moves_;
   is_initialized_ = true;
 }
@@ -1653,10 +2040,14 @@ WinningCondition Position::MakeMoveReversibly(
   PlayerPosition& our = player_positions_[player];
   PlayerPosition& foe = player_positions_[Opponent(player)];
   our.RemoveTwoBridgesBeforeOurMoveOrAfterFoeMoveReversibly(cell, memento);
+  const bool only_nearby = our.MoveWouldOnlyExtendOneChain(cell);
   const WinningCondition result = our.MakeMoveReversibly(cell, memento);
   our.CreateTwoBridgesAfterOurMoveReversibly(cell, foe, memento);
   our.FindNewRingFramesReversibly(memento);
+  our.UpdateWinningCellsAfterOurMoveReversibly(
+      cell, foe, only_nearby, memento);
   foe.RemoveTwoBridgesBeforeOurMoveOrAfterFoeMoveReversibly(cell, memento);
+  foe.UpdateWinningCellsAfterFoeMoveReversibly(cell, memento);
   memento->Remember(&move_count_);
   ++move_count_;
   return result;
@@ -1680,19 +2071,24 @@ WinningCondition Position::MakePermanentMove(Player player, Cell cell) {
   PlayerPosition& our = player_positions_[player];
   PlayerPosition& foe = player_positions_[Opponent(player)];
   our.RemoveTwoBridgesBeforeOurMoveOrAfterFoeMoveReversibly(cell, memento);
+  const bool only_nearby = our.MoveWouldOnlyExtendOneChain(cell);
   const WinningCondition result = our.MakeMoveReversibly(cell, memento);
   our.CreateTwoBridgesAfterOurMoveReversibly(cell, foe, memento);
   our.FindNewRingFramesReversibly(memento);
   our.UpdateChainsToNewestVersionsReversibly(memento);
+  our.UpdateWinningCellsAfterOurMoveReversibly(
+      cell, foe, only_nearby, memento);
   foe.RemoveTwoBridgesBeforeOurMoveOrAfterFoeMoveReversibly(cell, memento);
+  foe.UpdateWinningCellsAfterFoeMoveReversibly(cell, memento);
   mementoes_.push_back(memento);
   past_moves_.resize(move_count_);
   past_moves_.push_back(std::make_pair(player, cell));
+  Cell* const available_cell =
+      std::find(available_cells_, available_cells_ + num_available_moves_,
+                cell);
+  assert(available_cell != available_cells_ + num_available_moves_);
   num_available_moves_ = static_cast<MoveIndex>(num_available_moves_ - 1);
-  const Cell swapped_cell = kMoveIndexToCell[num_available_moves_];
-  const MoveIndex move = kCellToMoveIndex[cell];
-  std::swap(kCellToMoveIndex[cell], kCellToMoveIndex[swapped_cell]);
-  std::swap(kMoveIndexToCell[move], kMoveIndexToCell[num_available_moves_]);
+  std::swap(*available_cell, available_cells_[num_available_moves_]);
   ++move_count_;
   return result;
 }
@@ -1704,7 +2100,7 @@ bool Position::UndoPermanentMove() {
   mementoes_.back()->UndoAll();
   delete mementoes_.back();
   mementoes_.pop_back();
-  assert(past_moves_.back().second == kMoveIndexToCell[num_available_moves_]);
+  assert(past_moves_.back().second == available_cells_[num_available_moves_]);
   past_moves_.pop_back();
   num_available_moves_ = NextMove(num_available_moves_);
   --move_count_;
@@ -1797,90 +2193,361 @@ int Position::GetDistance(Cell cell1, Cell cell2) {
   return (abs(x1 - x2) + abs(y1 - y2) + abs(z1 - z2)) / 2;
 }
 
-//-- Memento ----------------------------------------------------------
-void Memento::UndoAll() {
-  for (std::vector<std::pair<unsigned*, unsigned> >::reverse_iterator rit =
-       words_.rbegin(); rit != words_.rend(); ++rit) {
-    *(rit->first) = rit->second;
+//-- CompactPosition --------------------------------------------------
+void CompactPosition::InitFromPosition(const Position& position) {
+  stones_[kWhite].ZeroBits();
+  stones_[kBlack].ZeroBits();
+  for (MoveIndex move = kZerothMove; move < kNumMovesOnBoard;
+       move = NextMove(move)) {
+    const Cell cell = Position::MoveIndexToCell(move);
+    for (int p = 0; p < 2; ++p) {
+      const Player player = static_cast<Player>(p);
+      if (position.player_position(player).StoneIsInCell(cell))
+        MakeMove(player, cell);
+    }
   }
-  words_.clear();
-  for (std::vector<std::pair<ChainSet*, int> >::reverse_iterator rit =
-       sizes_.rbegin(); rit != sizes_.rend(); ++rit) {
-    rit->first->ShrinkTo(rit->second);
+}
+
+WinningCondition CompactPosition::MakeMove(Player player, Cell cell) {
+  assert(CellIsEmpty(cell));
+  const XCoord x = CellToX(cell);
+  const YCoord y = CellToY(cell);
+  BoardBitmask& stones = stones_[player];
+  const unsigned neighborhood = stones.Get6Neighbors(x, y);
+  stones.set(x, y);
+  const MoveIndex move = Position::CellToMoveIndex(cell);
+  parents_[move] = move;
+  unsigned edges_corners = Position::GetMaskOfEdgesAndCorners(cell);
+  // Hang the chains around the stone under it, counting them.
+  int num_chains = 0;
+  for (int i = 0; i < 6; ++i) {
+    const Cell neighbor = OffsetCell(cell, kNeighborOffsets[i]);
+    if (!stones.get(CellToX(neighbor), CellToY(neighbor)))
+      continue;
+    const MoveIndex root = FindRoot(Position::CellToMoveIndex(neighbor));
+    if (root != move) {
+      ++num_chains;
+      edges_corners |= edges_corners_[root];
+      parents_[root] = move;
+    }
+  }
+  edges_corners_[move] = edges_corners;
+  int result = kNoWinningCondition;
+  if (CountSetBits(edges_corners) >= 3)
+    result |= kFork;
+  if (CountSetBits(edges_corners >> 6) >= 2)
+    result |= kBridge;
+  if (Position::CountNeighborGroups(neighborhood) > num_chains) {
+    // Two groups of neighbors from one chain enclose the cells between them.
+    result |= kRing;
+  } else if (CountSetBits(neighborhood) >= 3) {
+    // The stone may complete a ring around a stone of the player.
+    for (int i = 0; i < 6; ++i) {
+      const Cell neighbor = OffsetCell(cell, kNeighborOffsets[i]);
+      const XCoord nx = CellToX(neighbor);
+      const YCoord ny = CellToY(neighbor);
+      if (stones.get(nx, ny) && stones.Get6Neighbors(nx, ny) == 63) {
+        result |= kRing;
+        break;
+      }
+    }
   }
-  sizes_.clear();
+  return static_cast<WinningCondition>(result);
 }
 
-//-- ChainAllocator ---------------------------------------------------
-ChainAllocator::~ChainAllocator() {
-  Node* next;
-  for (Node* p = head_; p != NULL; p = next) {
-    next = p->next;
-    delete p;
+MoveIndex CompactPosition::FindRoot(MoveIndex move) {
+  while (parents_[move] != move) {
+    parents_[move] = parents_[parents_[move]];
+    move = static_cast<MoveIndex>(parents_[move]);
   }
+  return move;
 }
 
-Chain* ChainAllocator::MakeChain() {
-  if (head_ != NULL) {
-    Node* first = head_;
-    head_ = first->next;
-    return reinterpret_cast<Chain*>(first);
-  } else {
-    return new Chain;
+//-- VirtualConnections -----------------------------------------------
+VirtualConnections::~VirtualConnections() {
+  for (size_t i = 0; i < liberties_.size(); ++i) {
+    delete liberties_[i];
+    delete reach_[i];
   }
 }
 
-void ChainAllocator::DeleteChain(Chain* chain)  {
-  if (chain != NULL) {
-    Node* first = reinterpret_cast<Node*>(chain);
-    first->next = head_;
-    head_ = first;
+bool VirtualConnections::FindFrame(
+    const PlayerPosition& pp, const PlayerPosition& op) {
+  for (YCoord y = kZeroY; y < kBoardHeight; y = NextY(y)) {
+    empty_cells_.Row(y) = Position::GetBoardBitmask().Row(y) &
+        ~pp.stone_mask().Row(y) & ~op.stone_mask().Row(y);
+  }
+  num_groups_ = 0;
+  // Edges and corners come first, so that groups 0-11 stand for them.
+  for (int i = 0; i < 12; ++i) {
+    AddGroup(1 << i)->ZeroBits();
+  }
+  for (YCoord y = kGapAround; y < kPastRows; y = NextY(y)) {
+    RowBitmask row = empty_cells_.Row(y);
+    for (XCoord x = kZeroX; row != 0; x = NextX(x), row >>= 1) {
+      if (row & 1) {
+        const unsigned edges_corners =
+            Position::GetMaskOfEdgesAndCorners(XYToCell(x, y));
+        for (int i = 0; i < 12; ++i) {
+          if (edges_corners & (1 << i))
+            liberties_[i]->set(x, y);
+        }
+      }
+    }
+  }
+  std::set<const Chain*> current_chains;
+  pp.GetCurrentChains(&current_chains);
+  for (std::set<const Chain*>::const_iterator it = current_chains.begin();
+       it != current_chains.end(); ++it) {
+    AddGroup((*it)->edges_corners_ring() & 0xfff)->FillWithNeighborMask(
+        (*it)->stone_mask(), op.stone_mask());
+  }
+  for (int i = 0; i < num_groups_; ++i) {
+    reach_[i]->FillWithNeighborMask(*liberties_[i], op.stone_mask());
+  }
+
+  std::vector<std::pair<int, std::pair<int, int> > > order;
+  connections_.clear();
+  for (int i = 0; i < num_groups_; ++i) {
+    for (int j = std::max(i + 1, 12); j < num_groups_; ++j) {
+      Carrier carrier;
+      if (!AreJoined(i, j) && FindConnection(i, j, &carrier)) {
+        order.push_back(std::make_pair(carrier.size, std::make_pair(i, j)));
+        connections_.push_back(carrier);
+      }
+    }
+  }
+  // Kruskal's algorithm: the smallest carriers leave most room
+  // for the others.
+  std::vector<int> index(order.size());
+  for (size_t k = 0; k < order.size(); ++k) {
+    index[k] = k;
+  }
+  std::sort(index.begin(), index.end(), OrderComparator(order));
+  used_cells_.ZeroBits();
+  std::vector<int> used;
+  for (size_t k = 0; k < index.size(); ++k) {
+    const int first = order[index[k]].second.first;
+    const int second = order[index[k]].second.second;
+    const Carrier& carrier = connections_[index[k]];
+    if (AreJoined(first, second) || Intersects(carrier, used_cells_))
+      continue;
+    for (int c = 0; c < carrier.size; ++c) {
+      used_cells_.set(CellToX(carrier.cells[c]), CellToY(carrier.cells[c]));
+    }
+    used.push_back(index[k]);
+    const int root = Join(first, second);
+    group_moves_[root] += carrier.moves;
+    group_moves_if_intruded_[root] += carrier.moves_if_intruded;
+    if (IsFrame(edges_corners_[root])) {
+      moves_ = group_moves_[root];
+      moves_if_intruded_ = group_moves_if_intruded_[root];
+      // The tree may hold connections that the frame does not need,
+      // which only makes the moves an overestimate.
+      carrier_.ZeroBits();
+      for (size_t u = 0; u < used.size(); ++u) {
+        if (Find(order[used[u]].second.second) != root)
+          continue;
+        const Carrier& c = connections_[used[u]];
+        for (int n = 0; n < c.size; ++n) {
+          carrier_.set(CellToX(c.cells[n]), CellToY(c.cells[n]));
+        }
+      }
+      return true;
+    }
+  }
+  return false;
+}
+
+bool VirtualConnections::Intersects(
+    const Carrier& carrier, const BoardBitmask& mask) {
+  for (int c = 0; c < carrier.size; ++c) {
+    if (Contains(mask, carrier.cells[c]))
+      return true;
+  }
+  return false;
+}
+
+bool VirtualConnections::AreDisjoint(const Carrier& a, const Carrier& b) {
+  for (int i = 0; i < a.size; ++i) {
+    for (int j = 0; j < b.size; ++j) {
+      if (a.cells[i] == b.cells[j])
+        return false;
+    }
   }
+  return true;
+}
+
+BoardBitmask* VirtualConnections::AddGroup(unsigned edges_corners) {
+  if (static_cast<size_t>(num_groups_) == liberties_.size()) {
+    // FillWithNeighborMask() leaves the rows around the board unset,
+    // and the neighbors of the cells of the board may lie there.
+    liberties_.push_back(new BoardBitmask);
+    liberties_.back()->ZeroBits();
+    reach_.push_back(new BoardBitmask);
+    reach_.back()->ZeroBits();
+    parent_.push_back(0);
+    edges_corners_.push_back(0);
+    group_moves_.push_back(0);
+    group_moves_if_intruded_.push_back(0);
+  }
+  parent_[num_groups_] = num_groups_;
+  edges_corners_[num_groups_] = edges_corners;
+  group_moves_[num_groups_] = 0;
+  group_moves_if_intruded_[num_groups_] = 0;
+  return liberties_[num_groups_++];
+}
+
+int VirtualConnections::Find(int group) {
+  while (parent_[group] != group) {
+    parent_[group] = parent_[parent_[group]];
+    group = parent_[group];
+  }
+  return group;
+}
+
+bool VirtualConnections::AreJoined(int first, int second) {
+  if (first < 12)
+    return (edges_corners_[Find(second)] & (1 << first)) != 0;
+  return Find(first) == Find(second);
+}
+
+int VirtualConnections::Join(int first, int second) {
+  if (first < 12) {
+    // The edge or corner joins the tree without linking it to others.
+    const int root = Find(second);
+    edges_corners_[root] |= 1 << first;
+    return root;
+  }
+  first = Find(first);
+  second = Find(second);
+  if (first != second) {
+    parent_[second] = first;
+    edges_corners_[first] |= edges_corners_[second];
+    group_moves_[first] += group_moves_[second];
+    group_moves_if_intruded_[first] += group_moves_if_intruded_[second];
+  }
+  return first;
+}
+
+void VirtualConnections::AddSemiConnections(
+    int first, int second, bool with_common, std::vector<Carrier>* semi) {
+  const BoardBitmask& from = *liberties_[first];
+  const BoardBitmask& to = *liberties_[second];
+  for (YCoord y = kGapAround; y < kPastRows; y = NextY(y)) {
+    RowBitmask row = from.Row(y) & (to.Row(y) | reach_[second]->Row(y));
+    for (XCoord x = kZeroX; row != 0; x = NextX(x), row >>= 1) {
+      if ((row & 1) == 0)
+        continue;
+      if (semi->size() == static_cast<size_t>(kMaxSemiConnections))
+        return;
+      Carrier carrier;
+      carrier.cells[0] = XYToCell(x, y);
+      if (to.get(x, y)) {
+        if (!with_common)
+          continue;
+        carrier.size = 1;
+        carrier.moves = 1;
+      } else {
+        // A stone in the cell leaves a two-bridge to fill.
+        carrier.size = 1;
+        carrier.moves = 2;
+        for (int n = 0; n < 6 && carrier.size < 3; ++n) {
+          const Cell neighbor = NthNeighbor(carrier.cells[0], n);
+          if (Contains(to, neighbor))
+            carrier.cells[carrier.size++] = neighbor;
+        }
+        if (carrier.size < 3)
+          continue;
+      }
+      carrier.moves_if_intruded = carrier.moves;
+      semi->push_back(carrier);
+    }
+  }
+}
+
+bool VirtualConnections::FindConnection(
+    int first, int second, Carrier* carrier) {
+  semi_.clear();
+  AddSemiConnections(first, second, true, &semi_);
+  AddSemiConnections(second, first, false, &semi_);
+  int best_size = INT_MAX;
+  for (size_t i = 0; i < semi_.size(); ++i) {
+    for (size_t j = i + 1; j < semi_.size(); ++j) {
+      const int size = semi_[i].size + semi_[j].size;
+      if (size < best_size && AreDisjoint(semi_[i], semi_[j])) {
+        best_size = size;
+        carrier->size = size;
+        // An intrusion into one semi-connection forces the other.
+        carrier->moves = std::min(semi_[i].moves, semi_[j].moves);
+        carrier->moves_if_intruded = std::max(semi_[i].moves, semi_[j].moves);
+        std::copy(semi_[i].cells, semi_[i].cells + semi_[i].size,
+                  carrier->cells);
+        std::copy(semi_[j].cells, semi_[j].cells + semi_[j].size,
+                  carrier->cells + semi_[i].size);
+      }
+    }
+  }
+  return best_size != INT_MAX;
+}
+
+//-- Memento ----------------------------------------------------------
+void Memento::UndoAll() {
+  std::vector<std::pair<unsigned*, unsigned> >& words = log_->words_;
+  assert(first_word_ <= words.size());
+  for (size_t i = words.size(); i > first_word_; --i) {
+    *(words[i - 1].first) = words[i - 1].second;
+  }
+  words.resize(first_word_);
+  std::vector<std::pair<ChainSet*, int> >& sizes = log_->sizes_;
+  assert(first_size_ <= sizes.size());
+  for (size_t i = sizes.size(); i > first_size_; --i) {
+    sizes[i - 1].first->ShrinkTo(sizes[i - 1].second);
+  }
+  sizes.resize(first_size_);
 }
 
 //-- Arena ------------------------------------------------------------
-Arena::Arena() : top_(0) {}
+Arena::Arena(unsigned max_cells)
+    : max_cells_(max_cells), cells_(NULL), top_(0) {
+  void* addresses = mmap(NULL, max_cells_ * sizeof(unsigned),
+                         PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANON | MAP_NORESERVE, -1, 0);
+  if (addresses == MAP_FAILED) {
+    fprintf(stderr, "Cannot reserve memory for an Arena\n");
+    exit(EXIT_FAILURE);
+  }
+  cells_ = static_cast<unsigned*>(addresses);
+}
 
 Arena::~Arena() {
-  for (int i = 0, size = chunks_.size(); i < size; ++i) {
-    delete[] chunks_[i];
-  }
+  munmap(cells_, max_cells_ * sizeof(unsigned));
 }
 
 unsigned Arena::Allocate(int n) {
-  assert(n <= kCellsInChunk);
-  if ((top() + n) / kCellsInChunk >= chunks_.size()) {
-    chunks_.push_back(new unsigned[kCellsInChunk]);
-    top_ = (top() + n) / kCellsInChunk * kCellsInChunk;
-  }
-  int result = top();
-  memset(&chunks_[result / kCellsInChunk][result % kCellsInChunk],
-         0, n * sizeof(unsigned));
+  const unsigned result = top();
+  assert(result + n <= max_cells_);
+  memset(cells_ + result, 0, n * sizeof(unsigned));
   top_ += n;
   return result;
 }
 
-// TODO(mciura): Avoid unnecessary deletes.
 void Arena::CopyFrom(const Arena& other) {
-  for (int i = 0, size = chunks_.size(); i < size; ++i) {
-    delete[] chunks_[i];
-  }
-  chunks_.clear();
-  for (int i = 0, size = other.chunks_.size(); i < size; ++i) {
-    chunks_.push_back(new unsigned[kCellsInChunk]);
-    memcpy(chunks_[i], other.chunks_[i], sizeof(unsigned[kCellsInChunk]));
-  }
+  assert(other.top() <= max_cells_);
+  memcpy(cells_, other.cells_, other.top() * sizeof(unsigned));
   top_ = other.top();
 }
 
 //-- RingDB -----------------------------------------------------------
 RingDB::RingDB()
-    : chain_graph_(arena_.Allocate(kChainNumLimit)),
+    : arena_(kMaxArenaCells),
+      chain_graph_(arena_.Allocate(kChainNumLimit)),
       ring_frames_(arena_.Allocate(kMaxNumRingFrames)),
       ring_frames_top_(ring_frames_),
       ring_frames_through_cells_(arena_.Allocate(kNumMovesOnBoard)),
-      changed_(false) {
-  memset(blocked_bridges_, 0, sizeof blocked_bridges_);
+      changed_(false),
+      merge_epoch_(0) {
+  memset(seen_two_bridges_, 0, sizeof seen_two_bridges_);
 }
 
 void RingDB::AddTwoBridgeReversibly(
@@ -2016,7 +2683,7 @@ void RingDB::MergeChainEdgesReversibly(
   assert(chain1 == chain_set.NewestVersion(chain1));
   if (chain0 == chain1)
     return;
-  seen_two_bridges_.clear();
+  ForgetSeenTwoBridges();
   ChainNum new_chain = chain_set.size();
   // List[new_chain] = List[chain0]
   const unsigned first = chain_graph_ + new_chain;
@@ -2029,8 +2696,7 @@ void RingDB::MergeChainEdgesReversibly(
       const unsigned ch = arena_.get(curr + kCgChain);
       const unsigned c0 = arena_.get(curr + kCgCell0);
       const unsigned c1 = arena_.get(curr + kCgCell1);
-      const std::pair<unsigned, unsigned> two_bridge = std::make_pair(c0, c1);
-      seen_two_bridges_.insert(two_bridge);
+      MarkTwoBridgeSeen(c0, c1);
       if (ch == chain0 || ch == chain1) {
         memento->Remember(&arena_.get(curr + kCgChain));
         arena_.set(curr + kCgChain, new_chain);
@@ -2052,8 +2718,7 @@ void RingDB::MergeChainEdgesReversibly(
     const unsigned ch = arena_.get(curr + kCgChain);
     const unsigned c0 = arena_.get(curr + kCgCell0);
     const unsigned c1 = arena_.get(curr + kCgCell1);
-    const std::pair<unsigned, unsigned> two_bridge = std::make_pair(c0, c1);
-    if (seen_two_bridges_.find(two_bridge) == seen_two_bridges_.end()) {
+    if (!TwoBridgeWasSeen(c0, c1)) {
       if (ch == chain0 || ch == chain1) {
         memento->Remember(&arena_.get(curr + kCgChain));
         arena_.set(curr + kCgChain, new_chain);
@@ -2078,7 +2743,7 @@ void RingDB::MergeChainEdgesFast(
   assert(chain1 == chain_set.NewestVersion(chain1));
   if (chain0 == chain1)
     return;
-  seen_two_bridges_.clear();
+  ForgetSeenTwoBridges();
   ChainNum new_chain = chain_set.size();
   // List[new_chain] = List[chain0]
   const unsigned first = chain_graph_ + new_chain;
@@ -2090,8 +2755,7 @@ void RingDB::MergeChainEdgesFast(
       const unsigned ch = arena_.get(curr + kCgChain);
       const unsigned c0 = arena_.get(curr + kCgCell0);
       const unsigned c1 = arena_.get(curr + kCgCell1);
-      const std::pair<unsigned, unsigned> two_bridge = std::make_pair(c0, c1);
-      seen_two_bridges_.insert(two_bridge);
+      MarkTwoBridgeSeen(c0, c1);
       if (ch == chain0 || ch == chain1) {
         arena_.set(curr + kCgChain, new_chain);
       }
@@ -2110,8 +2774,7 @@ void RingDB::MergeChainEdgesFast(
     const unsigned ch = arena_.get(curr + kCgChain);
     const unsigned c0 = arena_.get(curr + kCgCell0);
     const unsigned c1 = arena_.get(curr + kCgCell1);
-    const std::pair<unsigned, unsigned> two_bridge = std::make_pair(c0, c1);
-    if (seen_two_bridges_.find(two_bridge) == seen_two_bridges_.end()) {
+    if (!TwoBridgeWasSeen(c0, c1)) {
       if (ch == chain0 || ch == chain1) {
         arena_.set(curr + kCgChain, new_chain);
       }
@@ -2127,6 +2790,45 @@ void RingDB::MergeChainEdgesFast(
   changed_ = true;
 }
 
+namespace {
+
+// Returns a bit telling the direction from cell0 to cell1 > cell0.
+unsigned TwoBridgeDirection(unsigned cell0, unsigned cell1) {
+  assert(cell0 < cell1);
+  switch (cell1 - cell0) {
+    case kRight: return 1;
+    case kDownRight: return 2;
+    case kDownLeft: return 4;
+  }
+  assert(false);
+  return 0;
+}
+
+}  // namespace
+
+void RingDB::ForgetSeenTwoBridges() {
+  ++merge_epoch_;
+  if (merge_epoch_ == (1u << (32 - 3))) {
+    memset(seen_two_bridges_, 0, sizeof seen_two_bridges_);
+    merge_epoch_ = 1;
+  }
+}
+
+void RingDB::MarkTwoBridgeSeen(unsigned cell0, unsigned cell1) {
+  unsigned& seen = seen_two_bridges_[
+      Position::CellToMoveIndex(static_cast<Cell>(cell0))];
+  if ((seen >> 3) != merge_epoch_)
+    seen = merge_epoch_ << 3;
+  seen |= TwoBridgeDirection(cell0, cell1);
+}
+
+bool RingDB::TwoBridgeWasSeen(unsigned cell0, unsigned cell1) const {
+  const unsigned seen = seen_two_bridges_[
+      Position::CellToMoveIndex(static_cast<Cell>(cell0))];
+  return (seen >> 3) == merge_epoch_ &&
+      (seen & TwoBridgeDirection(cell0, cell1)) != 0;
+}
+
 void RingDB::ReplaceChainInGraphReversibly(
     ChainNum chain, ChainNum old_chain, ChainNum new_chain, Memento* memento) {
   for (unsigned p = arena_.get(chain_graph_ + chain); p != 0;
@@ -2148,16 +2850,42 @@ void RingDB::ReplaceChainInGraphFast(
   }
 }
 
+namespace {
+
+// Upper bound for the number of Chains visited by FindCycles().
+// Every visited Chain contains at least one stone.
+enum { kMaxCycleNodes = (kNumMovesOnBoard + 31) & ~31 };
+// Number of words in a bitset of cycle nodes.
+enum { kCycleNodeWords = kMaxCycleNodes / 32 };
+
+// Scratch area of Johnson's algorithm. The B-sets take O(N**2) bits, so
+// one copy per thread is kept here instead of one in every RingDB.
+struct CycleSearch {
+  // Number of vertices visited by the current search.
+  int num_nodes;
+  // For each vertex, its Chain.
+  ChainNum node_chains[kMaxCycleNodes];
+  // For each Chain, its vertex. Valid only if node_chains agrees.
+  unsigned short chain_nodes[kChainNumLimit];
+  // Is a vertex blocked from search?
+  bool blocked[kMaxCycleNodes];
+  // Graph portions that yield no elementary circuit, as bitsets of vertices.
+  unsigned b_sets[kMaxCycleNodes][kCycleNodeWords];
+  // Has this cell already been used in the path?
+  bool blocked_bridges[kNumMovesOnBoard];
+};
+
+// Zero-initialized, which is all that chain_nodes and blocked_bridges need.
+__thread CycleSearch g_cycle_search;
+
+}  // namespace
+
 void RingDB::FindNewCyclesReversibly(
     ChainNum modified_chain, const ChainSet& chain_set, Memento* memento) {
   if (changed_) {
     assert(path_.empty());
     assert(bridges_.empty());
-    for (std::map<ChainNum, std::set<ChainNum> >::iterator it =
-         b_sets_.begin(); it != b_sets_.end(); ++it) {
-      it->second.clear();
-    }
-    memset(blocked_, 0, sizeof blocked_);
+    g_cycle_search.num_nodes = 0;
     FindCycles(modified_chain, modified_chain, chain_set, memento);
     changed_ = false;
   }
@@ -2172,9 +2900,11 @@ void RingDB::FindNewCyclesFast(
 bool RingDB::FindCycles(
     ChainNum this_node, ChainNum start_node, const ChainSet& chain_set,
     Memento* memento) {
+  CycleSearch& search = g_cycle_search;
   bool closed = false;
   path_.push_back(this_node);
-  blocked_[this_node] = true;
+  const int this_index = CycleNode(this_node);
+  search.blocked[this_index] = true;
   for (unsigned p = arena_.get(chain_graph_ + this_node);
        p != 0; p = arena_.get(p)) {
     const ChainNum next_node = arena_.get(p + kCgChain);
@@ -2182,48 +2912,69 @@ bool RingDB::FindCycles(
     Cell c1 = static_cast<Cell>(arena_.get(p + kCgCell1));
     const MoveIndex m0 = Position::CellToMoveIndex(c0);
     const MoveIndex m1 = Position::CellToMoveIndex(c1);
-    if (blocked_bridges_[m0] || blocked_bridges_[m1])
+    if (search.blocked_bridges[m0] || search.blocked_bridges[m1])
       continue;
-    blocked_bridges_[m0] = blocked_bridges_[m1] = true;
+    search.blocked_bridges[m0] = search.blocked_bridges[m1] = true;
     bridges_.push_back(std::make_pair(c0, c1));
     if (next_node == start_node) {
       VerifyCycle(chain_set, memento);
       closed = true;
-    } else if (!blocked_[next_node]) {
+    } else if (static_cast<int>(path_.size()) == kMaxRingFrameLength) {
+      // The path is too long to be extended. The vertices on it might
+      // still lie on shorter cycles, so they must not stay blocked.
+      closed = true;
+    } else if (!search.blocked[CycleNode(next_node)]) {
       closed |= FindCycles(next_node, start_node, chain_set, memento);
     }
     bridges_.pop_back();
-    blocked_bridges_[m0] = blocked_bridges_[m1] = false;
+    search.blocked_bridges[m0] = search.blocked_bridges[m1] = false;
   }
   if (closed) {
-    Unblock(this_node);
+    Unblock(this_index);
   } else {
+    const unsigned this_bit = 1u << (this_index % 32);
     for (unsigned p = arena_.get(chain_graph_ + this_node);
          p != 0; p = arena_.get(p)) {
       const ChainNum next_node = arena_.get(p + kCgChain);
-      b_sets_[next_node].insert(this_node);
+      search.b_sets[CycleNode(next_node)][this_index / 32] |= this_bit;
     }
   }
   path_.pop_back();
   return closed;
 }
 
-void RingDB::Unblock(ChainNum this_node) {
-  if (blocked_[this_node]) {
-    blocked_[this_node] = false;
-    std::set<ChainNum>& this_b_set = b_sets_[this_node];
-    for (std::set<ChainNum>::iterator it = this_b_set.begin();
-         it != this_b_set.end(); /**/) {
-      Unblock(*it);
-      std::set<ChainNum>::iterator bit = it;
-      ++it;
-      // By clause 23.1.2 of the C++ standard, the erase method shall
-      // invalidate only iterators and references to the erased elements.
-      this_b_set.erase(bit);
+void RingDB::Unblock(int this_node) {
+  CycleSearch& search = g_cycle_search;
+  if (search.blocked[this_node]) {
+    search.blocked[this_node] = false;
+    // Unblocked vertices never get into B-sets until FindCycles() leaves
+    // them, so the recursion cannot add bits to this B-set.
+    unsigned* this_b_set = search.b_sets[this_node];
+    for (int i = 0; i < kCycleNodeWords; ++i) {
+      unsigned word = this_b_set[i];
+      this_b_set[i] = 0;
+      while (word != 0) {
+        Unblock(32 * i + CountTrailingZeroes(word));
+        word &= word - 1;
+      }
     }
   }
 }
 
+int RingDB::CycleNode(ChainNum chain) {
+  CycleSearch& search = g_cycle_search;
+  const int node = search.chain_nodes[chain];
+  if (node < search.num_nodes && search.node_chains[node] == chain)
+    return node;
+  assert(search.num_nodes < kMaxCycleNodes);
+  const int new_node = search.num_nodes++;
+  search.node_chains[new_node] = chain;
+  search.chain_nodes[chain] = new_node;
+  search.blocked[new_node] = false;
+  memset(search.b_sets[new_node], 0, sizeof search.b_sets[new_node]);
+  return new_node;
+}
+
 void RingDB::VerifyCycle(const ChainSet& chain_set, Memento* memento) {
   const int size = path_.size();
   assert(size != 0);
@@ -2287,7 +3038,8 @@ void RingDB::VerifyCycle(const ChainSet& chain_set, Memento* memento) {
   if (all == 0)
     return;
   const int ring_frame_index = ring_frames_top_ - ring_frames_;
-  assert(ring_frame_index < kMaxNumRingFrames);
+  if (ring_frame_index == kMaxNumRingFrames)
+    return;
   memento->Remember(&ring_frames_top_);
   memento->Remember(&arena_.top());
   unsigned p = arena_.Allocate(2 * size + 1);
@@ -2313,6 +3065,24 @@ void RingDB::CopyFrom(const RingDB& other) {
   changed_ = other.changed_;
 }
 
+void RingDB::CompactFrom(const RingDB& other, const ChainSet& other_chain_set,
+                         const ChainNum* renumbering) {
+  CopyFrom(other);
+  // The lists of the newest versions of Chains share no records, so
+  // they are renumbered in place. Superseded Chains lose their lists.
+  // Since renumbering[ch] <= ch, no list is moved before it is read.
+  for (int i = 1, size = other_chain_set.size(); i < size; ++i) {
+    const unsigned first = arena_.get(chain_graph_ + i);
+    arena_.set(chain_graph_ + i, 0);
+    if (other_chain_set.newer_version(i) != PlayerPosition::kNullChain)
+      continue;
+    for (unsigned p = first; p != 0; p = arena_.get(p)) {
+      arena_.set(p + kCgChain, renumbering[arena_.get(p + kCgChain)]);
+    }
+    arena_.set(chain_graph_ + renumbering[i], first);
+  }
+}
+
 std::string RingDB::MakeString(const ChainSet& chain_set) const {
   std::string result;
   std::set<ChainNum> newest_versions;
@@ -2338,4 +3108,5 @@ std::string RingDB::MakeString(const ChainSet& chain_set) const {
   return result;
 }
 
+}  // namespace SIZED_NAMESPACE
 }  // namespace lajkonik
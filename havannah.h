@@ -35,7 +35,6 @@
 #include <stddef.h>
 #include <string.h>
 #include <algorithm>
-#include <map>
 #include <set>
 #include <string>
 #include <utility>
@@ -44,6 +43,7 @@
 #include "base.h"
 
 namespace lajkonik {
+namespace SIZED_NAMESPACE {
 
 STATIC_ASSERT(SIDE_LENGTH_must_be_greater_or_equal_to_3, SIDE_LENGTH >= 3);
 
@@ -78,7 +78,15 @@ enum WinningCondition {
   kFork = 8
 };
 
-// These two types index two-dimensional arrays with kThirtyTwoX columns
+// An unsigned type for marking cells in one row of the board.
+// Boards wider than 32 cells need 64-bit rows.
+#if SIDE_LENGTH <= 14
+typedef unsigned RowBitmask;
+#else
+typedef uint64 RowBitmask;
+#endif
+
+// These two types index two-dimensional arrays with kCellsInRow columns
 // and kBoardHeight rows. The arrays reflect the hexagonal board as below.
 // The sentinels on their sides simplify the getting of the neighbors
 // of a given cell.
@@ -100,7 +108,7 @@ enum XCoord {
   kMiddleColumn = kGapLeft + SIDE_LENGTH - 1,
   kLastColumn = kGapLeft + SIDE_LENGTH - 1 + SIDE_LENGTH - 1,
   kPastColumns = kLastColumn + 1,
-  kThirtyTwoX = 32
+  kCellsInRow = 8 * sizeof(RowBitmask)
 };
 
 enum YCoord {
@@ -121,16 +129,20 @@ inline YCoord PrevY(YCoord y) { return static_cast<YCoord>(y - 1); }
 // Indexes one-dimensional versions of the above-mentioned arrays.
 enum Cell {
   kZerothCell = 0,
-  kBoardCenter = 32 * kMiddleRow + kMiddleColumn,
-  kNumCellsWithSentinels = 32 * kBoardHeight
+  kBoardCenter = kCellsInRow * kMiddleRow + kMiddleColumn,
+  kNumCellsWithSentinels = kCellsInRow * kBoardHeight
 };
 
 // Converts between XCoord, YCoord, and Cell.
 inline Cell XYToCell(XCoord x, YCoord y) {
-  return static_cast<Cell>(32 * y + x);
+  return static_cast<Cell>(kCellsInRow * y + x);
+}
+inline XCoord CellToX(Cell cell) {
+  return static_cast<XCoord>(cell % kCellsInRow);
+}
+inline YCoord CellToY(Cell cell) {
+  return static_cast<YCoord>(cell / kCellsInRow);
 }
-inline XCoord CellToX(Cell cell) { return static_cast<XCoord>(cell % 32); }
-inline YCoord CellToY(Cell cell) { return static_cast<YCoord>(cell / 32); }
 
 // Returns a cell given its reference point and relative offset.
 inline Cell OffsetCell(Cell cell, int offset) {
@@ -157,18 +169,19 @@ inline MoveIndex NextMove(MoveIndex move) {
 // An unsigned type representing the index of a chain in a ChainSet.
 // The smaller the type is, the better an array with kNumCellsWithSentinels
 // ChainNum elements fits into the cache.
-typedef unsigned char ChainNum;
-enum { kChainNumLimit = (1 << (8 * sizeof(ChainNum))) };
-
-// An unsigned type for marking cells in one row of the board.
-typedef unsigned RowBitmask;
+typedef unsigned short ChainNum;
+// Every move adds at most two Chains and superseded Chains are reclaimed
+// only when a Position is copied, so the limit must exceed two Chains per
+// move of a game plus twice the search depth. RingDB keeps one arena cell
+// per ChainNum in a single chunk of its Arena.
+enum { kChainNumLimit = (kNumMovesOnBoard < 600) ? (1 << 11) : (1 << 12) };
+STATIC_ASSERT(chain_num_limit_must_fit_in_chain_num,
+              kChainNumLimit <= (1 << (8 * sizeof(ChainNum))));
 
 // Used for Zobrist hashing, in which the Hash of a position
 // is a bitwise XOR of Hashes of all its moves.
 typedef uint64 Hash;
 
-STATIC_ASSERT(row_must_have_32_cells, sizeof(RowBitmask) == 4);
-
 // The width of the board, including gaps around it.
 const int kBoardWidth =
     kGapLeft + SIDE_LENGTH - 1 + SIDE_LENGTH + kGapAround;
@@ -237,8 +250,9 @@ class PrintableBoard {
   virtual char GetCharForCell(XCoord x, YCoord y) const = 0;
 };
 
-// A bit mask of stones on the board.
-class BoardBitmask : public PrintableBoard {
+// A bit mask of stones on the board. It is printed through MaskPrinter
+// and has no virtual methods, so it is as large as its rows.
+class BoardBitmask {
  public:
   BoardBitmask() {}
   ~BoardBitmask() {}
@@ -256,18 +270,38 @@ class BoardBitmask : public PrintableBoard {
       rows_[i] = first.rows_[i] | second.rows_[i];
     }
   }
+  // ANDs first with second into this BoardBitmask.
+  // Both arguments can be equal to this, if needed.
+  void FillWithAnd(const BoardBitmask& first, const BoardBitmask& second) {
+    for (int i = 0; i < ARRAYSIZE(rows_); ++i) {
+      rows_[i] = first.rows_[i] & second.rows_[i];
+    }
+  }
+  // Returns true if no cell is set.
+  bool IsZero() const {
+    for (int i = 0; i < ARRAYSIZE(rows_); ++i) {
+      if (rows_[i] != 0)
+        return false;
+    }
+    return true;
+  }
   // TODO(mciura)
   void FillWithNeighborMask(
       const BoardBitmask& player_stones,
       const BoardBitmask& opponent_stones);
+  // Sets the cells of the board that are set in mask or have
+  // at least two neighbors set in mask.
+  void FillWithMaskOrTwiceAdjacent(const BoardBitmask& mask);
   // Getters for rows_[y].
   const RowBitmask& Row(YCoord y) const { return rows_[y]; }
   RowBitmask& Row(YCoord y) { return rows_[y]; }
 
   // General-purpose getter and setters.
-  bool get(XCoord x, YCoord y) const { return (Row(y) & (1 << x)); }
-  void set(XCoord x, YCoord y) { Row(y) |= (1 << x); }
-  void clear(XCoord x, YCoord y) { Row(y) &= ~(1 << x); }
+  bool get(XCoord x, YCoord y) const { return (Row(y) & Bit(x)); }
+  void set(XCoord x, YCoord y) { Row(y) |= Bit(x); }
+  void clear(XCoord x, YCoord y) { Row(y) &= ~Bit(x); }
+  // Returns the mask of the xth cell in a row.
+  static RowBitmask Bit(XCoord x) { return static_cast<RowBitmask>(1) << x; }
 
   // Returns the 6-bit immediate neighborhood of the given cell
   // composed of this BoardBitmasks's stones.
@@ -277,9 +311,6 @@ class BoardBitmask : public PrintableBoard {
   Cell GetSampleStone() const;
 
  private:
-  virtual char GetCharForCell(XCoord x, YCoord y) const {
-    return Row(y) & (1 << x) ? 'x' : '.';
-  }
   // TODO(mciura)
   RowBitmask rows_[kBoardHeight];
 
@@ -287,6 +318,25 @@ class BoardBitmask : public PrintableBoard {
   void operator=(const BoardBitmask&);
 };
 
+// Makes a BoardBitmask, for instance the stones of a Chain, printable.
+class MaskPrinter : public PrintableBoard {
+ public:
+  explicit MaskPrinter(const BoardBitmask& mask) : mask_(mask) {}
+  virtual ~MaskPrinter() {}
+
+ private:
+  // Returns 'x' if the mask contains the cell at coordinates (x, y)
+  // or '.' if it does not.
+  virtual char GetCharForCell(XCoord x, YCoord y) const {
+    return mask_.get(x, y) ? 'x' : '.';
+  }
+
+  const BoardBitmask& mask_;
+
+  MaskPrinter(const MaskPrinter&);
+  void operator=(const MaskPrinter&);
+};
+
 // A counter for each cell on the board.
 class BoardCounter : public PrintableBoard {
  public:
@@ -302,6 +352,7 @@ class BoardCounter : public PrintableBoard {
 
   // General-purpose getter and setters.
   unsigned char& get(Cell cell) { return board_[cell]; }
+  unsigned char get(Cell cell) const { return board_[cell]; }
   void zero(Cell cell) { board_[cell] = 0; }
   void increment(Cell cell) {
     ++board_[cell];
@@ -329,8 +380,9 @@ class BoardCounter : public PrintableBoard {
 // See part IV below.
 class Memento;
 
-// A group of adjacent stones of one color.
-class Chain : public PrintableBoard {
+// A group of adjacent stones of one color. Chains live in the pool
+// of a ChainSet, which also links their versions.
+class Chain {
  public:
   Chain() {}
   ~Chain() {}
@@ -348,6 +400,8 @@ class Chain : public PrintableBoard {
   // at coordinates (x, y).
   void InitWithStone(XCoord x, YCoord y);
   void InitWithStoneOutsideBoard(XCoord x, YCoord y);
+  // Makes this Chain contain no stones.
+  void Clear();
   // Returns a nonzero value if this chain forms a winning configuration.
   WinningCondition IsVictory();
   // Clones the other Chain to this Chain.
@@ -367,12 +421,6 @@ class Chain : public PrintableBoard {
   unsigned edges() const { return edges_corners_ring_ & 63; }
   unsigned corners() const { return (edges_corners_ring_ >> 6) & 63; }
   bool ring() const { return (edges_corners_ring_ >> 12) & 1; }
-  // Setters and getter for newer_version_.
-  void SetNewerVersionReversibly(ChainNum nv, Memento* memento);
-  void SetNewerVersionFast(ChainNum nv) {
-    newer_version_ = nv;
-  }
-  int newer_version() const { return newer_version_; }
 
  private:
   // Returns (1 << 13) if putting a stone in the cell at coordinates (x, y)
@@ -381,11 +429,6 @@ class Chain : public PrintableBoard {
   // Returns the ring bits for a stone put in the cell at coordinates (x, y).
   // They are (1 << 12) for any ring and (1 << 13) for a benzene ring.
   unsigned GetRingMask(XCoord x, YCoord y) const;
-  // Returns 'x' if this Chain contains a stone in the cell at coordinates
-  // (x, y) or '.' if it does not.
-  virtual char GetCharForCell(XCoord x, YCoord y) const {
-    return ((stone_mask().Row(y) >> x) & 1)[".x"];
-  }
 
   // The xth bit of stone_mask_.Row(y) is set if this Chain
   // contains a stone in the cell at coordinates (x, y).
@@ -399,43 +442,11 @@ class Chain : public PrintableBoard {
   // it tells if this Chain contains a benzene ring. The 16th bit and above
   // are garbage.
   unsigned edges_corners_ring_;
-  // The index of the Chain that supersedes this Chain or zero if none does.
-  // Such a linked list of chains where only one head is updated on a union
-  // operation seems faster than a full-blown disjoint set with reversible
-  // unions from
-  // S. Conchon, J.-C. Filliâtre: A Persistent Union-Find Structure,
-  // http://www.lri.fr/~filliatr/publis/puf-wml07.ps
-  ChainNum newer_version_;
 
   Chain(const Chain&);
   void operator=(const Chain&);
 };
 
-// A freelist allocator for Chains. It decreases the memory management
-// contention in multithreaded versions of Lajkonik. Each Chain has its
-// own ChainAllocator.
-class ChainAllocator {
- public:
-  ChainAllocator() : head_(NULL) {}
-  ~ChainAllocator();
-
-  // TODO(mciura)
-  Chain* MakeChain();
-  // TODO(mciura)
-  void DeleteChain(Chain* chain);
-
- private:
-  // An element of the freelist.
-  struct Node {
-    Node* next;
-  };
-  // The head of the freelist.
-  Node* head_;
-
-  ChainAllocator(const ChainAllocator&);
-  void operator=(const ChainAllocator&);
-};
-
 // All chains of stones of one player.
 class ChainSet {
  public:
@@ -455,80 +466,100 @@ class ChainSet {
   // Appends to chains_[] a new Chain consisting of one stone
   // in the cell at coordinates (x, y). Returns the index of the new Chain.
   ChainNum MakeOneStoneChain(XCoord x, YCoord y);
-  // TODO(mciura)
-  ChainNum push_back(Chain* chain);
+  // Appends to chains_[] a copy of the chain or an empty Chain
+  // if chain is NULL. Returns the index of the new Chain.
   ChainNum PushBackChainOutsideBoard(const Chain* chain);
   // Returns the index of the Chain that supersedes chains_[ch].
   ChainNum NewestVersion(ChainNum ch) const;
-  //
+  // Returns the number of Chains not superseded by other Chains.
   int CountChains() const;
-  const Chain* NewestVersion(const Chain* ch) const;
   // Returns the edges_corners_ring mask of the Chain
   // that supersedes chains_[ch].
   unsigned edges_corners_ring(ChainNum ch) const {
-    return chains_[NewestVersion(ch)]->edges_corners_ring();
+    return chains_[NewestVersion(ch)].edges_corners_ring();
   }
   // Returns a nonzero value if chains_[NewestVersion(ch)]
   // forms a winning configuration.
   WinningCondition IsVictory(ChainNum ch) {
-    return chains_[NewestVersion(ch)]->IsVictory();
+    return chains_[NewestVersion(ch)].IsVictory();
   }
   // Getters used for testing.
   const BoardBitmask& stone_mask(ChainNum ch) const {
-    return chains_[ch]->stone_mask();
+    return chains_[ch].stone_mask();
   }
   const BoardBitmask& newest_stone_mask(ChainNum ch) const {
-    return chains_[NewestVersion(ch)]->stone_mask();
+    return chains_[NewestVersion(ch)].stone_mask();
   }
   unsigned edges(ChainNum ch) const {
-    return chains_[NewestVersion(ch)]->edges();
+    return chains_[NewestVersion(ch)].edges();
   }
   unsigned corners(ChainNum ch) const {
-    return chains_[NewestVersion(ch)]->corners();
+    return chains_[NewestVersion(ch)].corners();
   }
   bool ring(ChainNum ch) const {
-    return chains_[NewestVersion(ch)]->ring();
+    return chains_[NewestVersion(ch)].ring();
   }
-  // Returns the underlying ChainAllocator;
-  ChainAllocator& allocator() { return allocator_; }
   // Returns the number of elements in chains_[].
-  int size() const { return chains_.size(); }
-  // Reserves space for n Chains.
-  void Reserve(int n);
+  int size() const { return size_; }
   // Removes the tail of chains_[], leaving at most n of them.
-  void ShrinkTo(int n);
-  // Setter and getter for chains_[];
-  void set_chain(int n, Chain* ch) { chains_[n] = ch; }
-  const Chain* chain(int n) const { return chains_[n]; }
+  void ShrinkTo(int n) {
+    if (n < size_)
+      size_ = n;
+  }
+  // Clones the Chains of the other ChainSet into this ChainSet.
+  void CopyFrom(const ChainSet& other);
+  // Clones only the Chains of the other ChainSet that no Chain supersedes,
+  // numbering them consecutively. Sets renumbering[ch] to the new index
+  // of other.NewestVersion(ch) for 0 < ch < other.size().
+  void CompactFrom(const ChainSet& other, ChainNum* renumbering);
+  // Getters for chains_[] and newer_versions_[].
+  const Chain* chain(int n) const { return &chains_[n]; }
+  ChainNum newer_version(ChainNum ch) const { return newer_versions_[ch]; }
   // Returns a string representation of NewestVersion(ch).
   std::string MakeString(ChainNum ch) const {
-    return chains_[NewestVersion(ch)]->MakeString();
+    return MaskPrinter(newest_stone_mask(ch)).MakeString();
   }
   std::string MakeClassicalString(ChainNum ch) const {
-    return chains_[NewestVersion(ch)]->MakeClassicalString();
+    return MaskPrinter(newest_stone_mask(ch)).MakeClassicalString();
   }
   std::string MakeLittleGolemString(ChainNum ch) const {
-    return chains_[NewestVersion(ch)]->MakeLittleGolemString();
+    return MaskPrinter(newest_stone_mask(ch)).MakeLittleGolemString();
   }
 
  private:
-  // The ChainAllocator for this ChainSet;
-  ChainAllocator allocator_;
-  // The Chains of this ChainSet. The element at index zero is NULL.
-  std::vector<Chain*> chains_;
+  // Returns the index of a new Chain superseded by no Chain.
+  ChainNum AppendChain();
+
+  // The Chains of this ChainSet, contiguous so that a lookup goes through
+  // one pointer only. The element at index zero is unused. Allocated once
+  // on the heap: kChainNumLimit Chains would not fit on a thread stack.
+  Chain* chains_;
+  // The index of the Chain that supersedes each Chain or zero if none does.
+  // Kept apart from chains_[] so that NewestVersion() walks a few bytes.
+  // Such a linked list of chains where only one head is updated on a union
+  // operation seems faster than a full-blown disjoint set with reversible
+  // unions from
+  // S. Conchon, J.-C. Filliâtre: A Persistent Union-Find Structure,
+  // http://www.lri.fr/~filliatr/publis/puf-wml07.ps
+  ChainNum* newer_versions_;
+  // The number of elements of chains_[] in use.
+  int size_;
 
   ChainSet(const ChainSet&);
   void operator=(const ChainSet&);
 };
 
-// Arena allocator for RingDB.
+// Arena allocator for RingDB. Its cells lie in one reserved range
+// of addresses, so they never move and a Memento can remember them.
 class Arena {
  public:
-  Arena();
+  // Reserves max_cells cells. The system commits memory for them
+  // only when they are first written to.
+  explicit Arena(unsigned max_cells);
   ~Arena();
 
-  // Allocates n cells and zeroes them.
-  // Returns the index of the first allocated cell.
+  // Allocates n cells and zeroes them. At most max_cells cells
+  // can be allocated in total. Returns the index of the first one.
   unsigned Allocate(int n);
 
   // Getter for top_.
@@ -537,24 +568,24 @@ class Arena {
   // Gets the contents of the nth cell.
   const unsigned& get(unsigned n) const {
     assert(n < top());
-    return chunks_[n / kCellsInChunk][n % kCellsInChunk];
+    return cells_[n];
   }
 
   // Sets the contents of the nth cell to value.
   void set(unsigned n, unsigned value) {
     assert(n < top());
-    chunks_[n / kCellsInChunk][n % kCellsInChunk] = value;
+    cells_[n] = value;
   }
 
-  // Clones the other Arena to this one.
+  // Clones the other Arena, which has at most as many cells,
+  // to this one.
   void CopyFrom(const Arena& other);
 
  private:
-  // How many unsigned cells are there in one chunk of the Arena?
-  static const int kCellsInChunk = (1 << 12);
-
-  // The underlying chunks of memory.
-  std::vector<unsigned*> chunks_;
+  // The number of cells reserved.
+  const unsigned max_cells_;
+  // The reserved range of addresses.
+  unsigned* cells_;
   // The first unallocated cell.
   unsigned top_;
 
@@ -606,6 +637,10 @@ class RingDB {
 
   // Clones the other RingDB to this one.
   void CopyFrom(const RingDB& other);
+  // Clones the other RingDB to this one, renumbering its Chains
+  // like ChainSet::CompactFrom() does with other_chain_set.
+  void CompactFrom(const RingDB& other, const ChainSet& other_chain_set,
+                   const ChainNum* renumbering);
   // Returns a string representation of the adjacency graph.
   std::string MakeString(const ChainSet& chain_set) const;
 
@@ -617,6 +652,23 @@ class RingDB {
   enum { kRftcRingFrameIndex = 1, kRftcSize };
   // Upper bound for the number of ring frames during the game.
   static const int kMaxNumRingFrames = (1 << 8);
+  // Upper bound for the number of two-bridges in a ring frame. Longer
+  // ring frames are too far from a win to matter for the evaluation,
+  // and there can be exponentially many of them on a crowded board.
+  static const int kMaxRingFrameLength = 8;
+  // Upper bound for the number of cells allocated in arena_: the heads
+  // of the lists of chain_graph_, ring_frames_ and
+  // ring_frames_through_cells_, at most kMaxNumRingFrames ring frames,
+  // each with a record per cell of its two-bridges, and two records for
+  // each of the at most six two-bridges that one move creates. Records
+  // are never freed but on undo, so this holds for a whole game.
+  static const unsigned kMaxArenaCells =
+      kChainNumLimit + kMaxNumRingFrames + kNumMovesOnBoard +
+      kMaxNumRingFrames *
+          (2 * kMaxRingFrameLength + 1 + 2 * kMaxRingFrameLength * kRftcSize) +
+      kNumMovesOnBoard * 6 * 2 * kCgSize;
+  STATIC_ASSERT(arena_cells_must_be_counted_by_int,
+                kMaxArenaCells < (1U << 31) / sizeof(unsigned));
 
   // Adds to chain_graph_[chain0]
   // a two-bridge to chain1 on m0 and m1.
@@ -637,14 +689,25 @@ class RingDB {
   void ReplaceChainInGraphFast(
       ChainNum chain, ChainNum old_chain, ChainNum new_chain);
 
+  // Forgets all two-bridges seen by MergeChainEdges...(). Time: O(1).
+  void ForgetSeenTwoBridges();
+  // Records that the two-bridge on cell0 < cell1 was seen.
+  void MarkTwoBridgeSeen(unsigned cell0, unsigned cell1);
+  // Was the two-bridge on cell0 < cell1 seen?
+  bool TwoBridgeWasSeen(unsigned cell0, unsigned cell1) const;
+
   // Donald B. Johnson, Finding All the Elementary Circuits of a Directed
   // Graph, SIAM J. Comput. vol. 4, no. 1, March 1975, pp. 77-84.
   // Time complexity: O((v + e)(c + 1)) for v vertices, e edges, c cycles.
   // Appears to work incrementally. Appears to work for multigraphs.
+  // Only finds cycles of at most kMaxRingFrameLength edges.
   bool FindCycles(
       ChainNum this_node, ChainNum start_node, const ChainSet& chain_set,
       Memento* memento);
-  void Unblock(ChainNum this_node);
+  void Unblock(int this_node);
+  // Returns the index of chain among the nodes of the current search,
+  // giving it a new index if it was not visited yet.
+  int CycleNode(ChainNum chain);
   void VerifyCycle(const ChainSet& chain_set, Memento* memento);
   void AddRingFrameIndexToCell(
       Cell cell, int ring_frame_index, Memento* memento);
@@ -665,20 +728,19 @@ class RingDB {
   // Do we have to find cycles passing through the largest ChainNum?
   bool changed_;
 
-  // Used in MergeChainEdges...().
-  std::set<std::pair<unsigned, unsigned> > seen_two_bridges_;
+  // Used in MergeChainEdges...(). For each MoveIndex of the lower cell
+  // of a two-bridge, merge_epoch_ shifted left by 3 ORed with a bitmask
+  // of the directions to the higher cells of the two-bridges seen.
+  unsigned seen_two_bridges_[kNumMovesOnBoard];
+  unsigned merge_epoch_;
 
   // The following data structures are for Johnson's algoprithm.
   // Stack of vertices in the current path.
   std::vector<ChainNum> path_;
   // Stack of bridges between vertices of the current path.
   std::vector<std::pair<Cell, Cell> > bridges_;
-  // Is a vertex blocked from search?
-  bool blocked_[kChainNumLimit];
-  // Graph portions that yield no elementary circuit.
-  std::map<ChainNum, std::set<ChainNum> > b_sets_;
-  // Has this cell already been used in the path?
-  bool blocked_bridges_[kNumMovesOnBoard];
+  // The other per-search data lives in a scratch area in havannah.cc,
+  // shared by all RingDBs of a thread.
 
   // Used in VerifyCycle().
   BoardBitmask stones_;
@@ -693,6 +755,8 @@ class BfsResult {
   BfsResult() {}
   ~BfsResult() {}
 
+  void SetAllTo(int value) { memset(distance, value, sizeof distance); }
+
   void set(Cell cell, int value) {
     assert(cell >= kZerothCell);
     assert(cell < kNumCellsWithSentinels);
@@ -717,6 +781,30 @@ class BfsResult {
   void operator=(const BfsResult&);
 };
 
+// The three partitions of the six edges into the pairs of edges
+// that fork frames join.
+extern const int kForkPartitions[3][6];
+
+// Returns the length of the fork frame of the partition
+// given the distances from a chain to the six edges.
+inline int ForkFrameLength(const int distance[6], const int partition[6]) {
+  int length = 0;
+  for (int j = 0; j < 6; j += 2) {
+    length += std::min(distance[partition[j]], distance[partition[j + 1]]);
+  }
+  return length;
+}
+
+// Returns the length of the shortest fork frame
+// given the distances from a chain to the six edges.
+inline int ShortestForkFrame(const int distance[6]) {
+  int length = ForkFrameLength(distance, kForkPartitions[0]);
+  for (int k = 1; k < 3; ++k) {
+    length = std::min(length, ForkFrameLength(distance, kForkPartitions[k]));
+  }
+  return length;
+}
+
 class Position;
 
 // Represents shortest distances to victory.
@@ -755,6 +843,17 @@ class PositionEvaluation {
       const PositionEvaluation& first,
       const PositionEvaluation& second);
 
+  // Lowers the distances to the shortest bridge frames between any two
+  // corners.  Equivalent to calling SetToCombination() for all 15 pairs
+  // of corners and SetToMinimum() after each, but makes a single pass.
+  void SetToMinimumWithBridgeFrames(const BfsResult from_corner[6]);
+  // Lowers the distances to the shortest fork frames that connect
+  // the chain with three edges.  Makes a single pass over all moves.
+  void SetToMinimumWithForkFrames(
+      const BfsResult& from_chain,
+      const Chain* chain,
+      const BfsResult from_edge[6]);
+
   std::string MakeString(const Position* position) const;
   std::string Get18Neighbors(
       Player player, Cell cell, const Position& position) const;
@@ -793,6 +892,28 @@ class PlayerPosition : public PrintableBoard {
   void RemoveTwoBridgesBeforeOurMoveOrAfterFoeMoveReversibly(
       Cell cell, Memento* memento);
   void RemoveTwoBridgesBeforeOurMoveOrAfterFoeMoveFast(Cell cell);
+  // Returns true if a stone in the empty cell would neither merge chains
+  // nor bring any chain to a new edge or corner.
+  bool MoveWouldOnlyExtendOneChain(Cell cell) const;
+  // Sets the bits of the new stone in the cell in the neighborhoods_
+  // of the 18 cells around it.
+  void AddStoneToNeighborhoodsReversibly(Cell cell, Memento* memento);
+  void AddStoneToNeighborhoodsFast(Cell cell);
+  // Updates winning_cells_ after a move of this player or of the opponent.
+  // After our move, only the cells next to the modified Chain can change;
+  // if only_nearby is true, only those at most two cells away from it.
+  void UpdateWinningCellsAfterOurMoveReversibly(
+      Cell cell, const PlayerPosition& opponent, bool only_nearby,
+      Memento* memento);
+  void UpdateWinningCellsAfterFoeMoveReversibly(Cell cell, Memento* memento);
+  // Returns true if a stone in the empty cell would form a winning
+  // configuration. Time complexity: O(1) unless it might close a ring.
+  bool MoveWouldWin(Cell cell) const;
+
+  // Fills counter with the number of two-bridges on each cell, computing
+  // them from scratch. Equals two_bridge_mask() for consistent positions.
+  void CountTwoBridges(
+      const PlayerPosition& opponent, BoardCounter* counter) const;
 
   // Called after updating two-bridges and chain edges.
   void FindNewRingFramesReversibly(Memento* memento) {
@@ -808,7 +929,7 @@ class PlayerPosition : public PrintableBoard {
   }
   // Returns the 18-bit neighborhood of the given cell
   // composed of this player's stones.
-  unsigned Get18Neighbors(Cell cell) const;
+  unsigned Get18Neighbors(Cell cell) const { return neighborhoods_[cell]; }
   // Returns true if move into cell would close a fork or a bridge,
   // where edges_corners is the static mask of edges and corners
   // the cell belongs to and injected_chain -- if nonzero -- is a chain
@@ -831,7 +952,8 @@ class PlayerPosition : public PrintableBoard {
   // This accelerates future calls to MakeMove...().
   // Should be called if the move just made is permanent.
   void UpdateChainsToNewestVersionsReversibly(Memento* memento);
-  // Clones the other PlayerPosition to this PlayerPosition.
+  // Clones the other PlayerPosition to this PlayerPosition. The clone
+  // keeps only the newest versions of Chains, renumbered from scratch.
   void CopyFrom(const PlayerPosition& other);
   // TODO(mciura): Refactor the methods below.
   ChainNum chain_for_cell(Cell cell) const { return chains_for_cells_[cell]; }
@@ -861,6 +983,8 @@ class PlayerPosition : public PrintableBoard {
   const BoardBitmask& stone_mask() const { return stone_mask_; }
   // Getter for two_bridge_mask_.
   const BoardCounter& two_bridge_mask() const { return two_bridge_mask_; }
+  // Getter for winning_cells_.
+  const BoardBitmask& winning_cells() const { return winning_cells_; }
   // Returns true if the cell lies on the board and is empty.
   bool CellIsEmpty(Cell cell) const {
     return (chains_for_cells_[cell] == kNullChain);
@@ -875,6 +999,20 @@ class PlayerPosition : public PrintableBoard {
       const Chain* start_chain,
       const PlayerPosition& op,
       BfsResult* result) const;
+  // Fills the results with one-distances from the six edges, that is
+  // with the numbers of empty cells on the shortest paths.  They never
+  // exceed the corresponding two-distances.  Distances greater than
+  // max_distance < BfsResult::kMaxDistance are cut to max_distance + 1.
+  void ComputeOneDistancesFromEdges(
+      const PlayerPosition& op,
+      int max_distance,
+      BfsResult result[6]) const;
+  // Returns a lower bound on the number of stones the player needs
+  // to win, or max_moves + 1 if it exceeds max_moves.  The bound is exact
+  // for one stone.  Forks and bridges are bounded by one-distances.  Rings
+  // of more stones are seen only as current ring frames, so the result
+  // does not bound them.
+  int BoundMovesToWin(const PlayerPosition& op, int max_moves) const;
 
   // Accessors for the current ring frames.
   int ring_frame_count() const { return ring_db_.ring_frame_count(); }
@@ -900,6 +1038,22 @@ class PlayerPosition : public PrintableBoard {
       return two_bridge_mask().GetCharForCell(x, y);
   }
 
+  // Returns a 6-bit mask of the two-bridges that a stone in the cell
+  // makes with other stones. Bit i stands for the two-bridge on the ith
+  // and (i + 1)th neighbors of the cell in clockwise order.
+  unsigned GetNewTwoBridges(Cell cell, const PlayerPosition& opponent) const;
+  // Returns a 6-bit mask of the two-bridges that pass through the cell.
+  // Bit i stands for the two-bridge between its (i - 1)th and (i + 1)th
+  // neighbors in clockwise order, which passes also through the ith one.
+  unsigned GetTwoBridgesThroughCell(Cell cell) const;
+  // Fills the results with one-distances from the six start Chains.
+  // See ComputeOneDistancesFromEdges().
+  void ComputeOneDistances(
+      const Chain* const start_chains[6],
+      const PlayerPosition& op,
+      int max_distance,
+      BfsResult result[6]) const;
+
   // The Chains of this player.
   ChainSet chain_set_;
   // The chains_for_cells_[cell] element is the index of the Chain from
@@ -913,6 +1067,12 @@ class PlayerPosition : public PrintableBoard {
   BoardBitmask stone_mask_;
   // The counters of this player's two-bridges.
   BoardCounter two_bridge_mask_;
+  // The empty cells where a stone of this player would win. Kept up to
+  // date by Position::MakeMoveReversibly() and MakePermanentMove().
+  BoardBitmask winning_cells_;
+  // The neighborhoods of all cells, as returned by Get18Neighbors().
+  // Patched around each new stone instead of computed on every call.
+  unsigned neighborhoods_[kNumCellsWithSentinels];
   // Database of ring frames.
   RingDB ring_db_;
 
@@ -920,12 +1080,13 @@ class PlayerPosition : public PrintableBoard {
   void operator=(const PlayerPosition&);
 };
 
-// The state of the game.
+// The state of the game. Its Chains lie on the heap, so a Position
+// takes tens of kilobytes and may live on the stack of any thread.
 class Position : public PrintableBoard {
  public:
   // Initializes kEdgesCornersNeighbors, kMovesToOrderedCells, kEdgeChains,
   // kCornerChains, kNeighbors, kZobristHash, kIsCellOnBoardBitmask,
-  // kIsVirtualEdge, and kIsVirtualCorner.
+  // kIsVirtualEdge, kIsVirtualCorner, and kIsDeadCellPattern.
   static void InitStaticFields();
 
   Position()
@@ -969,6 +1130,10 @@ class Position : public PrintableBoard {
   unsigned char GetCell(Cell cell) const { return cells_[cell]; }
   // Getter for num_available_moves_.
   MoveIndex NumAvailableMoves() const { return num_available_moves_; }
+  // Returns the nth cell in the order in which this Position offers
+  // moves. Cells occupied by permanent moves come after the first
+  // NumAvailableMoves() cells.
+  Cell NthAvailableCell(int n) const { return available_cells_[n]; }
   // Returns the move counter.
   int MoveCount() const { return move_count_; }
   // Returns true if the cell lies on the board and is empty.
@@ -998,6 +1163,22 @@ class Position : public PrintableBoard {
                player_position(Opponent(player)).Get18Neighbors(cell)) << 18) |
            player_position(player).Get18Neighbors(cell);
   }
+  // Returns true if player's stone put into the empty cell could never
+  // be a part of his winning frame: the cell has no empty neighbors,
+  // lies outside edges and corners unless it has no neighboring stones
+  // of player, and the stone would not join two of player's chains
+  // or close a ring.
+  bool CellIsDeadForPlayer(Player player, Cell cell) const {
+    const uint64 neighborhood = Get18Neighbors(player, cell);
+    return kIsDeadCellPattern[Get6NeighborsFrom18(neighborhood) |
+                              (Get6NeighborsFrom18(neighborhood >> 18) << 6)];
+  }
+  // Extracts the six-bit immediate neighborhood, as returned by
+  // Get6Neighbors(), from the lower 18 bits of Get18Neighbors().
+  static unsigned Get6NeighborsFrom18(uint64 neighborhood) {
+    return ((neighborhood >> 4) & 3) | ((neighborhood >> 6) & 12) |
+           ((neighborhood >> 8) & 48);
+  }
   // For testing. If s represents a valid Havannah board, sets this
   // to its internal representation and returns true. Otherwise clears
   // this and returns false;
@@ -1080,7 +1261,9 @@ class Position : public PrintableBoard {
   std::vector<std::pair<Player, Cell> > past_moves_;
   // The number of moves made.
   unsigned move_count_;
-  // Divides move_index_to_cell_ into random and historical parts.
+  // Permutation of kMoveIndexToCell whose tail holds permanent moves.
+  Cell available_cells_[kNumMovesOnBoard];
+  // Divides available_cells_ into random and historical parts.
   MoveIndex num_available_moves_;
   // True if the Position has been properly initialized.
   bool is_initialized_;
@@ -1104,10 +1287,8 @@ class Position : public PrintableBoard {
   //   #33#     2##3
   static uint64 kEdgesCornersNeighbors[kNumCellsWithSentinels];
   // Translates a dense cell index into an index to cells_.
-  static Cell kConstMoveIndexToCell[kNumMovesOnBoard];
   static Cell kMoveIndexToCell[kNumMovesOnBoard];
   // The Reverse transformation to kMoveIndexToCell.
-  static MoveIndex kConstCellToMoveIndex[kNumCellsWithSentinels];
   static MoveIndex kCellToMoveIndex[kNumCellsWithSentinels];
   // TODO(mciura)
   static Cell kNeighbors[kNumCellsWithSentinels][8];
@@ -1126,6 +1307,11 @@ class Position : public PrintableBoard {
   // The same as Position::kGroupCount but with 9s when three adjacent
   // neighboring cells are occupied by player's stones.
   static const unsigned char kGroupCountWithPossibleBenzeneRings[64];
+  // Indexed by the six-bit neighborhood of player's stones or cells
+  // outside the board ORed with the same neighborhood of opponent's
+  // stones or cells outside the board shifted by six bits. True when
+  // player's stone in the center would be dead.
+  static bool kIsDeadCellPattern[1 << 12];
   // Chains that mask six edges right outside the board.
   static Chain kEdgeChains[6];
   // Chains that mask six corners right outside the board.
@@ -1135,50 +1321,255 @@ class Position : public PrintableBoard {
   void operator=(const Position&);
 };
 
+// A position that keeps only what tells if a move wins: the stones
+// of both players and their chains as a union-find forest of cells.
+// It holds no pointers, so a search can copy it to the next ply
+// instead of undoing the moves with a Memento.
+class CompactPosition {
+ public:
+  CompactPosition() {}
+  ~CompactPosition() {}
+
+  // Initializes this to the stones of position.
+  void InitFromPosition(const Position& position);
+  // Copies other to this CompactPosition.
+  void CopyFrom(const CompactPosition& other) {
+    stones_[kWhite].CopyFrom(other.stones_[kWhite]);
+    stones_[kBlack].CopyFrom(other.stones_[kBlack]);
+    memcpy(parents_, other.parents_, sizeof parents_);
+    memcpy(edges_corners_, other.edges_corners_, sizeof edges_corners_);
+  }
+  // Puts a stone of player in the empty cell. Returns a nonzero value
+  // if the stone forms a winning configuration for the player.
+  WinningCondition MakeMove(Player player, Cell cell);
+  // Returns true if neither player has a stone in cell.
+  bool CellIsEmpty(Cell cell) const {
+    const XCoord x = CellToX(cell);
+    const YCoord y = CellToY(cell);
+    return !stones_[kWhite].get(x, y) && !stones_[kBlack].get(x, y);
+  }
+  // Getter for stones_[player].
+  const BoardBitmask& stone_mask(Player player) const {
+    return stones_[player];
+  }
+
+ private:
+  // Returns the root of the tree of the stone of the move,
+  // halving the path to it.
+  MoveIndex FindRoot(MoveIndex move);
+
+  // Indexing the arrays by MoveIndex instead of Cell makes copies smaller.
+  // Padding them to a multiple of 64 bytes makes copies twice as fast.
+  enum { kNumPaddedMoves = (kNumMovesOnBoard + 31) & ~31 };
+
+  // The stones of both players.
+  BoardBitmask stones_[2];
+  // The parent of each stone in the forest. Roots are their own parents.
+  unsigned short parents_[kNumPaddedMoves];
+  // The edges and corners touched by the chain of each root.
+  unsigned short edges_corners_[kNumPaddedMoves];
+
+  CompactPosition(const CompactPosition&);
+  void operator=(const CompactPosition&);
+};
+
+STATIC_ASSERT(moves_must_fit_in_unsigned_short,
+              kNumMovesOnBoard <= (1 << 16));
+
+// Proves connections between groups of a player, that is his chains,
+// edges, and corners, that hold even if the opponent moves first.
+// Uses the AND and OR rules of H-search from
+// V. V. Anshelevich: A hierarchical approach to computer Hex,
+// Artificial Intelligence 134 (2002), pp. 101-120.
+// A semi-connection needs one or two more moves of the player: a common
+// empty neighbor of two groups or an empty neighbor of one group that
+// forms a two-bridge with the other. Two semi-connections with disjoint
+// carriers make a connection. Connections with pairwise disjoint carriers
+// join groups, since the player can answer each intrusion in its carrier.
+class VirtualConnections {
+ public:
+  VirtualConnections() {}
+  ~VirtualConnections();
+
+  // Returns true if the connections of the player join two corners
+  // or three edges. Ignores rings.
+  bool FindFrame(const PlayerPosition& pp, const PlayerPosition& op);
+
+  // After FindFrame() returned true: the number of moves the player needs
+  // to connect the frame if the opponent never intrudes, which bounds
+  // from above the moves he needs besides the answers to intrusions.
+  int moves() const { return moves_; }
+  // After FindFrame() returned true: the number of moves the player needs
+  // at most whatever the opponent does.
+  int moves_if_intruded() const { return moves_if_intruded_; }
+  // After FindFrame() returned true: the empty cells of the connections
+  // that join the frame.
+  const BoardBitmask& carrier() const { return carrier_; }
+
+ private:
+  // At most two semi-connections of three empty cells each. Moves is
+  // the number of moves that connect through the cheaper semi-connection
+  // and moves_if_intruded through the dearer one.
+  struct Carrier {
+    int size;
+    int moves;
+    int moves_if_intruded;
+    Cell cells[6];
+  };
+
+  // Compares connections by the size of their carriers.
+  class OrderComparator {
+   public:
+    explicit OrderComparator(
+        const std::vector<std::pair<int, std::pair<int, int> > >& order)
+        : order_(order) {}
+    bool operator()(int a, int b) const { return order_[a] < order_[b]; }
+
+   private:
+    const std::vector<std::pair<int, std::pair<int, int> > >& order_;
+  };
+
+  // Semi-connections that a pair of groups has at most.
+  static const int kMaxSemiConnections = 12;
+
+  static bool IsFrame(unsigned edges_corners) {
+    return (CountSetBits(edges_corners & 63) >= 3 ||
+            CountSetBits((edges_corners >> 6) & 63) >= 2);
+  }
+  static bool Contains(const BoardBitmask& mask, Cell cell) {
+    return mask.get(CellToX(cell), CellToY(cell));
+  }
+  static bool Intersects(const Carrier& carrier, const BoardBitmask& mask);
+  static bool AreDisjoint(const Carrier& a, const Carrier& b);
+
+  // Appends a group with the given edges and corners and returns
+  // its liberties to be filled by the caller.
+  BoardBitmask* AddGroup(unsigned edges_corners);
+  // Returns the root of the group, halving the path to it.
+  int Find(int group);
+  // Returns true if the groups belong to one tree. The trees hold only
+  // chains, since touching one edge does not join two chains; an edge
+  // or corner belongs to a tree whose edges and corners include it.
+  bool AreJoined(int first, int second);
+  // Joins the trees of the groups, summing up their moves, or adds
+  // the first group to the edges and corners of the second one's tree
+  // if it is an edge or a corner. Returns the root of the joined tree.
+  int Join(int first, int second);
+
+  // Appends to semi the semi-connections through the empty neighbors
+  // of the first group. Skips common neighbors unless with_common is true.
+  void AddSemiConnections(
+      int first, int second, bool with_common, std::vector<Carrier>* semi);
+  // Combines two disjoint semi-connections between the groups with
+  // the smallest carriers into a connection.
+  bool FindConnection(int first, int second, Carrier* carrier);
+
+  BoardBitmask empty_cells_;
+  BoardBitmask used_cells_;
+  BoardBitmask carrier_;
+  int moves_;
+  int moves_if_intruded_;
+  int num_groups_;
+  // Empty cells next to each group and empty cells next to them.
+  std::vector<BoardBitmask*> liberties_;
+  std::vector<BoardBitmask*> reach_;
+  // The union-find forest of groups. Each root keeps the edges and
+  // corners of its tree and the moves of the connections inside it.
+  std::vector<int> parent_;
+  std::vector<unsigned> edges_corners_;
+  std::vector<int> group_moves_;
+  std::vector<int> group_moves_if_intruded_;
+  std::vector<Carrier> semi_;
+  std::vector<Carrier> connections_;
+
+  VirtualConnections(const VirtualConnections&);
+  void operator=(const VirtualConnections&);
+};
+
 // IV. AUXILIARIES
 
-// Classes ChainAllocator, Arena, and RingDB should also belong here.
+// Classes Arena and RingDB should also belong here.
+
+// A stack of remembered assignments and ChainSet sizes shared by
+// Mementoes. A search thread keeps one UndoLog for all its nodes,
+// so that remembering a change seldom allocates memory.
+class UndoLog {
+ public:
+  UndoLog() {}
+  ~UndoLog() {}
+
+ private:
+  friend class Memento;
+
+  // Remembered pointers and their pointees.
+  std::vector<std::pair<unsigned*, unsigned> > words_;
+  // Remembered sizes of ChainSets;
+  std::vector<std::pair<ChainSet*, int> > sizes_;
+
+  UndoLog(const UndoLog&);
+  void operator=(const UndoLog&);
+};
 
 // Undoes assignments to memory locations and shrinks ChainSets.
 class Memento {
  public:
-  Memento() {}
+  // Makes a Memento with its own UndoLog.
+  Memento() : log_(&own_log_), first_word_(0), first_size_(0) {}
+  // Makes a Memento that appends its changes to the log. Mementoes that
+  // share a log must be undone in the reverse order of their creation.
+  explicit Memento(UndoLog* log)
+      : log_(log),
+        first_word_(log->words_.size()),
+        first_size_(log->sizes_.size()) {}
   ~Memento() {}
 
   // Remembers pointers and their pointees.
   void Remember(unsigned* pointer) {
-    words_.push_back(std::make_pair(pointer, *pointer));
+    log_->words_.push_back(std::make_pair(pointer, *pointer));
   }
   void Remember(const unsigned* pointer) {
     Remember(const_cast<unsigned*>(pointer));
   }
-  void Remember(unsigned char* pointer) {
-    if (sizeof(ptrdiff_t) == sizeof pointer) {
-      ptrdiff_t tmp = reinterpret_cast<ptrdiff_t>(pointer) & -sizeof(unsigned);
-      Remember(reinterpret_cast<unsigned*>(tmp));
-    } else {
-      int64 tmp = reinterpret_cast<int64>(pointer) & -sizeof(unsigned);
-      Remember(reinterpret_cast<unsigned*>(tmp));
-    }
+  void Remember(unsigned char* pointer) { RememberWordContaining(pointer); }
+  void Remember(unsigned short* pointer) { RememberWordContaining(pointer); }
+  void Remember(uint64* pointer) {
+    Remember(reinterpret_cast<unsigned*>(pointer));
+    Remember(reinterpret_cast<unsigned*>(pointer) + 1);
   }
   // Remembers the size of a ChainSet.
   void RememberSize(ChainSet* chain_set) {
-    sizes_.push_back(std::make_pair(chain_set, chain_set->size()));
+    log_->sizes_.push_back(std::make_pair(chain_set, chain_set->size()));
   }
 
   // Restores all remembered state and forgets the changes.
   void UndoAll();
 
  private:
-  // Remembered pointers and their pointees.
-  std::vector<std::pair<unsigned*, unsigned> > words_;
-  // Remembered sizes of ChainSets;
-  std::vector<std::pair<ChainSet*, int> > sizes_;
+  // Remembers the unsigned word that contains the pointee.
+  void RememberWordContaining(void* pointer) {
+    if (sizeof(ptrdiff_t) == sizeof pointer) {
+      ptrdiff_t tmp = reinterpret_cast<ptrdiff_t>(pointer) & -sizeof(unsigned);
+      Remember(reinterpret_cast<unsigned*>(tmp));
+    } else {
+      int64 tmp = reinterpret_cast<int64>(pointer) & -sizeof(unsigned);
+      Remember(reinterpret_cast<unsigned*>(tmp));
+    }
+  }
+
+  // The log of the changes, either own_log_ or a shared one.
+  UndoLog* log_;
+  // The changes of this Memento start at these indices of the log.
+  size_t first_word_;
+  size_t first_size_;
+  // Used by Mementoes that share no log.
+  UndoLog own_log_;
 
   Memento(const Memento&);
   void operator=(const Memento&);
 };
 
+}  // namespace SIZED_NAMESPACE
+using namespace SIZED_NAMESPACE;
 }  // namespace lajkonik
 
 #endif  // HAVANNAH_H_
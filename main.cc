@@ -0,0 +1,160 @@
+
+// Copyright (c) 2010-2012 Marcin Ciura, Piotr Wieczorek
+//
+// Permission is hereby granted, free of charge, to any person
+// obtaining a copy of this software and associated documentation
+// files (the "Software"), to deal in the Software without
+// restriction, including without limitation the rights to use,
+// copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the
+// Software is furnished to do so, subject to the following
+// conditions:
+//
+// The above copyright notice and this permission notice shall be
+// included in all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+// EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+// OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+// NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+// HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+// WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+// OTHER DEALINGS IN THE SOFTWARE.
+
+// The main module for Havannah playing via GTP.
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+//#define USE_READLINE
+
+#ifdef USE_READLINE
+#include "readline/history.h"
+#include "readline/readline.h"
+#endif  // USE_READLINE
+
+#include "base.h"
+#include "frontend.h"
+
+namespace lajkonik {
+
+namespace {
+
+// The largest board whose rows fit in 64 bits.
+const int kMaxSideLength = 30;
+
+// Indexed by side length. Filled in during static initialization,
+// so they must need no dynamic initialization themselves.
+FrontendFactory g_factories[kMaxSideLength + 1];
+FrontendBase* g_frontends[kMaxSideLength + 1];
+
+// The frontend that handles the commands.
+FrontendBase* g_current_frontend = NULL;
+
+// Returns the frontend of the board size, creating it if needed,
+// or NULL if the size is not linked into the binary.
+FrontendBase* GetFrontend(int side_length) {
+  if (side_length < 0 || side_length > kMaxSideLength ||
+      g_factories[side_length] == NULL) {
+    return NULL;
+  }
+  if (g_frontends[side_length] == NULL)
+    g_frontends[side_length] = g_factories[side_length]();
+  return g_frontends[side_length];
+}
+
+template <typename T>
+void CopyOptionValues(
+    const std::vector<std::pair<const char*, T*> >& from,
+    std::vector<std::pair<const char*, T*> >* to) {
+  for (size_t i = 0; i < to->size(); ++i) {
+    for (size_t j = 0; j < from.size(); ++j) {
+      if (strcmp((*to)[i].first, from[j].first) == 0)
+        *(*to)[i].second = *from[j].second;
+    }
+  }
+}
+
+}  // namespace
+
+void FrontendBase::CopyOptionsFrom(const FrontendBase& other) {
+  CopyOptionValues(other.double_options_, &double_options_);
+  CopyOptionValues(other.int_options_, &int_options_);
+  CopyOptionValues(other.bool_options_, &bool_options_);
+}
+
+void RegisterFrontend(int side_length, FrontendFactory factory) {
+  assert(side_length >= 0 && side_length <= kMaxSideLength);
+  assert(g_factories[side_length] == NULL);
+  g_factories[side_length] = factory;
+}
+
+bool SwitchFrontend(int side_length) {
+  FrontendBase* frontend = GetFrontend(side_length);
+  if (frontend == NULL)
+    return false;
+  if (g_current_frontend != NULL && frontend != g_current_frontend)
+    frontend->CopyOptionsFrom(*g_current_frontend);
+  g_current_frontend = frontend;
+  return true;
+}
+
+}  // namespace lajkonik
+
+namespace {
+
+#ifdef USE_READLINE
+char* CommandGenerator(const char* text, int state) {
+  return lajkonik::g_current_frontend->GenerateCommand(text, state);
+}
+
+char** AntaresCompletion(const char* text, int start, int /*end*/) {
+  rl_attempted_completion_over = 1;
+  if (start == 0)
+    return rl_completion_matches(text, CommandGenerator);
+  else
+    return NULL;
+}
+#endif  // USE_READLINE
+
+char* GetLine() {
+  static char buffer[1024];
+#ifdef USE_READLINE
+  if (isatty(fileno(stdout)))
+    return readline(NULL);
+  else
+#endif  // USE_READLINE
+    return fgets(buffer, sizeof buffer, stdin);
+}
+
+}  // namespace
+
+int main() {
+  srand(time(NULL));
+  // Start with the largest board size linked into the binary.
+  int side_length = lajkonik::kMaxSideLength;
+  while (!lajkonik::SwitchFrontend(side_length)) {
+    --side_length;
+    if (side_length < 0) {
+      fprintf(stderr, "No board size is linked in\n");
+      return EXIT_FAILURE;
+    }
+  }
+#ifdef USE_READLINE
+  rl_attempted_completion_function = AntaresCompletion;
+#endif  // USE_READLINE
+  char* command;
+  while ((command = GetLine()) != NULL) {
+#ifdef USE_READLINE
+    if (command[0] != '\0')
+      add_history(command);
+#endif  // USE_RADLINE
+    lajkonik::g_current_frontend->HandleCommand(command);
+  }
+  return 0;
+}
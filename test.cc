@@ -23,41 +23,71 @@
 
 // Unit tests for havannah.cc
 
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <algorithm>
 #include <set>
 #include <string>
+#include <vector>
 
 #include "fct.h"
+#include "engine.h"
 #include "havannah.h"
 
 using lajkonik::uint64;
+using lajkonik::Hash;
 
 using lajkonik::Player;
 using lajkonik::XCoord;
 using lajkonik::YCoord;
 using lajkonik::Cell;
 using lajkonik::PositionEvaluation;
+using lajkonik::BfsResult;
+using lajkonik::MoveIndex;
 using lajkonik::RowBitmask;
+using lajkonik::Arena;
 using lajkonik::BoardBitmask;
+using lajkonik::BoardCounter;
 using lajkonik::ChainNum;
 using lajkonik::Chain;
 using lajkonik::ChainSet;
 using lajkonik::PlayerPosition;
 using lajkonik::Position;
+using lajkonik::CompactPosition;
+using lajkonik::MaskPrinter;
 using lajkonik::Memento;
+using lajkonik::UndoLog;
 
 using lajkonik::CountSetBits;
 using lajkonik::CountTrailingZeroes;
 using lajkonik::FromClassicalString;
 using lajkonik::FromLittleGolemString;
+using lajkonik::NextMove;
 using lajkonik::NextY;
+using lajkonik::Opponent;
+using lajkonik::ShortestForkFrame;
+
+using lajkonik::DescribesBoard;
+using lajkonik::ReadBatch;
+using lajkonik::EvaluateBatch;
+using lajkonik::CountMovesToWin;
+using lajkonik::VirtualConnections;
+
+using lajkonik::WinningCondition;
+using lajkonik::kNoWinningCondition;
+using lajkonik::kRing;
+using lajkonik::kBenzeneRing;
+using lajkonik::kBridge;
+using lajkonik::kFork;
 
 using lajkonik::kWhite;
 using lajkonik::kBlack;
 using lajkonik::kZeroX;
 using lajkonik::kGapLeft;
 using lajkonik::kMiddleColumn;
-using lajkonik::kThirtyTwoX;
+using lajkonik::kCellsInRow;
 using lajkonik::kZeroY;
 using lajkonik::kGapAround;
 using lajkonik::kMiddleRow;
@@ -66,6 +96,9 @@ using lajkonik::kBoardHeight;
 using lajkonik::kZerothCell;
 using lajkonik::kBoardCenter;
 using lajkonik::kNumCellsWithSentinels;
+using lajkonik::kZerothMove;
+using lajkonik::kForkPartitions;
+using lajkonik::kNumMovesOnBoard;
 
 using lajkonik::kNeighborOffsets;
 using lajkonik::kReverseNeighborhoods;
@@ -135,6 +168,18 @@ int SlowRing(int mask) {
   return (nonadjacent_stones >= 2);
 }
 
+// Returns a pseudorandom empty cell of the position, drawn with a linear
+// congruential generator that updates the seed, so that random games in
+// tests are reproducible.
+Cell NextRandomEmptyCell(const Position& position, unsigned* seed) {
+  Cell cell;
+  do {
+    *seed = *seed * 1103515245 + 12345;
+    cell = position.NthAvailableCell((*seed >> 16) % kNumMovesOnBoard);
+  } while (!position.CellIsEmpty(cell));
+  return cell;
+}
+
 }  // namespace
 
 // Slow implementation of Position::Get18Neighbors() on an empty board.
@@ -227,6 +272,95 @@ uint64 SlowNeighbors(const Position& position, Player player, Cell cell) {
   return result;
 }
 
+// Returns the number of cells whose Position::Get18Neighbors() differ
+// from SlowNeighbors().
+int CountNeighborhoodMismatches(const Position& position) {
+  int num_mismatches = 0;
+  for (int i = 0; i < kNumMovesOnBoard; ++i) {
+    const Cell cell = position.NthAvailableCell(i);
+    num_mismatches += (position.Get18Neighbors(kWhite, cell) !=
+                       SlowNeighbors(position, kWhite, cell));
+    num_mismatches += (position.Get18Neighbors(kBlack, cell) !=
+                       SlowNeighbors(position, kBlack, cell));
+  }
+  return num_mismatches;
+}
+
+// Plays the cells, separated by spaces, for the player.
+void PlayCells(
+    Player player, const std::string& cells,
+    Position* position, Memento* memento) {
+  for (size_t begin = 0; begin < cells.size(); /**/) {
+    size_t end = cells.find(' ', begin);
+    if (end == std::string::npos)
+      end = cells.size();
+    position->MakeMoveReversibly(
+        player, FromClassicalString(cells.substr(begin, end - begin)),
+        memento);
+    begin = end + 1;
+  }
+}
+
+// Returns true if the cells set in the mask are the cells,
+// separated by spaces.
+bool MaskHoldsCells(const BoardBitmask& mask, const std::string& cells) {
+  BoardBitmask expected;
+  expected.ZeroBits();
+  for (size_t begin = 0; begin < cells.size(); /**/) {
+    size_t end = cells.find(' ', begin);
+    if (end == std::string::npos)
+      end = cells.size();
+    const Cell cell = FromClassicalString(cells.substr(begin, end - begin));
+    expected.set(CellToX(cell), CellToY(cell));
+    begin = end + 1;
+  }
+  for (YCoord y = kGapAround; y < kPastRows; y = NextY(y)) {
+    if (mask.Row(y) != expected.Row(y))
+      return false;
+  }
+  return true;
+}
+
+// Plays the cells of the mask but skip for the player.
+// Returns true if one of them wins.
+bool FillMask(
+    Player player, const BoardBitmask& mask, Cell skip,
+    Position* position, Memento* memento) {
+  for (int i = 0; i < kNumMovesOnBoard; ++i) {
+    const Cell cell = position->NthAvailableCell(i);
+    if (cell != skip && mask.get(CellToX(cell), CellToY(cell)) &&
+        position->MakeMoveReversibly(player, cell, memento) !=
+            kNoWinningCondition) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Writes the text to a temporary file, evaluates the positions it holds
+// on num_threads threads, and returns the lines of the output.
+std::vector<std::string> EvaluateBatchOfText(
+    const std::string& text, int num_threads) {
+  char file_name[] = "/tmp/antares_batch_XXXXXX";
+  const int fd = mkstemp(file_name);
+  FILE* input = fdopen(fd, "w");
+  fputs(text.c_str(), input);
+  fclose(input);
+  std::vector<std::string> positions;
+  ReadBatch(file_name, &positions);
+  unlink(file_name);
+  FILE* output = tmpfile();
+  EvaluateBatch(positions, num_threads, output);
+  rewind(output);
+  std::vector<std::string> lines;
+  char buffer[256];
+  while (fgets(buffer, sizeof buffer, output) != NULL) {
+    lines.push_back(buffer);
+  }
+  fclose(output);
+  return lines;
+}
+
 FCT_BGN()
 
 FCT_QTEST_BGN(CountSetBits_gives_correct_results)
@@ -244,11 +378,27 @@ FCT_QTEST_BGN(CountTrailingZeroes_gives_correct_results)
              "CountTrailingZeroes(%d) returns %d while %d was expected",
              x, CountTrailingZeroes(x), SlowCountTrailingZeroes(x));
   }
+  for (int i = 0; i < 64; ++i) {
+    const uint64 x = (1ULL << i) | (1ULL << 63);
+    const int trailing_zeroes = CountTrailingZeroes(x);
+    fct_xchk(trailing_zeroes == i,
+             "CountTrailingZeroes(%llx) returns %d while %d was expected",
+             x, trailing_zeroes, i);
+  }
+FCT_QTEST_END();
+
+FCT_QTEST_BGN(Memento_restores_64_bit_words)
+  uint64 word = 0x0123456789abcdefULL;
+  Memento memento;
+  memento.Remember(&word);
+  word = ~0ULL;
+  memento.UndoAll();
+  fct_chk(word == 0x0123456789abcdefULL);
 FCT_QTEST_END();
 
 FCT_QTEST_BGN(LiesOnBoard_gives_correct_results)
   for (YCoord y = kZeroY; y < kBoardHeight; y = NextY(y)) {
-    for (XCoord x = kZeroX; x < kThirtyTwoX; x = NextX(x)) {
+    for (XCoord x = kZeroX; x < kCellsInRow; x = NextX(x)) {
       fct_xchk(LiesOnBoard(x, y) == (kBoard[y][x] != '.'),
                "LiesOnBoard(%d, %d) returns %d while the board has '%c'",
                x, y, LiesOnBoard(x, y), kBoard[y][x]);
@@ -274,7 +424,7 @@ FCT_QTEST_END();
 FCT_QTEST_BGN(FromClassicalString_reverses_ToClassicalString)
   fct_chk_eq_int(
       FromClassicalString("a1"),
-      32 * (kGapAround + 2 * SIDE_LENGTH - 2) + kGapLeft);
+      kCellsInRow * (kGapAround + 2 * SIDE_LENGTH - 2) + kGapLeft);
   for (Cell cell = kZerothCell; cell < kNumCellsWithSentinels;
        cell = NextCell(cell)) {
     if (!LiesOnBoard(CellToX(cell), CellToY(cell)))
@@ -289,7 +439,7 @@ FCT_QTEST_END();
 FCT_QTEST_BGN(FromLittleGolemString_reverses_ToLittleGolemString)
   fct_chk_eq_int(
       FromLittleGolemString("a1"),
-      32 * (kGapAround + 2 * SIDE_LENGTH - 2) + kGapLeft);
+      kCellsInRow * (kGapAround + 2 * SIDE_LENGTH - 2) + kGapLeft);
   for (Cell cell = kZerothCell; cell < kNumCellsWithSentinels;
        cell = NextCell(cell)) {
     if (!LiesOnBoard(CellToX(cell), CellToY(cell)))
@@ -364,6 +514,58 @@ FCT_QTEST_BGN(Memento_forgets_undone_changes)
   fct_chk_eq_int(chain_set.size(), PlayerPosition::kNumSpecialChains + 1);
 FCT_QTEST_END();
 
+FCT_QTEST_BGN(Memento_undoes_only_its_part_of_UndoLog)
+  static unsigned locations[2] = { 1, 2 };
+  ChainSet chain_set;
+  for (int i = 1; i < PlayerPosition::kNumSpecialChains; ++i) {
+    chain_set.PushBackChainOutsideBoard(NULL);
+  }
+  UndoLog undo_log;
+  Memento outer(&undo_log);
+  outer.Remember(&locations[0]);
+  locations[0]++;
+  outer.RememberSize(&chain_set);
+  chain_set.MakeOneStoneChain(static_cast<XCoord>(7), static_cast<YCoord>(7));
+  {
+    Memento inner(&undo_log);
+    inner.Remember(&locations[0]);
+    locations[0]++;
+    inner.Remember(&locations[1]);
+    locations[1]++;
+    inner.RememberSize(&chain_set);
+    chain_set.MakeOneStoneChain(
+        static_cast<XCoord>(8), static_cast<YCoord>(8));
+    inner.UndoAll();
+  }
+  fct_chk_eq_int(locations[0], 2);
+  fct_chk_eq_int(locations[1], 2);
+  fct_chk_eq_int(chain_set.size(), PlayerPosition::kNumSpecialChains + 1);
+  outer.UndoAll();
+  fct_chk_eq_int(locations[0], 1);
+  fct_chk_eq_int(chain_set.size(), PlayerPosition::kNumSpecialChains);
+FCT_QTEST_END();
+
+FCT_QTEST_BGN(Arena_reuses_zeroed_cells_after_undo)
+  Arena arena(4100);
+  const unsigned first = arena.Allocate(4090);
+  fct_chk_eq_int(first, 0);
+  Memento memento;
+  memento.Remember(&arena.top());
+  const unsigned second = arena.Allocate(10);
+  fct_chk_eq_int(second, 4090);
+  arena.set(4095, 7);
+  fct_chk_eq_int(arena.get(4095), 7);
+  memento.UndoAll();
+  fct_chk_eq_int(arena.top(), 4090);
+  const unsigned third = arena.Allocate(10);
+  fct_chk_eq_int(third, 4090);
+  fct_chk_eq_int(arena.get(4095), 0);
+  Arena copy(4100);
+  copy.CopyFrom(arena);
+  fct_chk_eq_int(copy.top(), 4100);
+  fct_chk_eq_int(copy.get(4099), 0);
+FCT_QTEST_END();
+
 FCT_QTEST_BGN(ChainSet_sets_board_correctly)
   ChainSet chain_set;
   for (int i = 1; i < PlayerPosition::kNumSpecialChains; ++i) {
@@ -371,7 +573,7 @@ FCT_QTEST_BGN(ChainSet_sets_board_correctly)
   }
   Memento memento;
   for (YCoord y = kZeroY; y < kBoardHeight; y = NextY(y)) {
-    for (XCoord x = kZeroX; x < kThirtyTwoX; x = NextX(x)) {
+    for (XCoord x = kZeroX; x < kCellsInRow; x = NextX(x)) {
       if (!LiesOnBoard(x, y))
         continue;
       memento.RememberSize(&chain_set);
@@ -384,6 +586,28 @@ FCT_QTEST_BGN(ChainSet_sets_board_correctly)
   }
 FCT_QTEST_END();
 
+FCT_QTEST_BGN(ChainSet_CopyFrom_clones_chains_and_versions)
+  ChainSet chain_set;
+  for (int i = 1; i < PlayerPosition::kNumSpecialChains; ++i) {
+    chain_set.PushBackChainOutsideBoard(NULL);
+  }
+  const Cell d4 = FromClassicalString("d4");
+  const XCoord x = CellToX(d4);
+  const YCoord y = CellToY(d4);
+  const ChainNum a = chain_set.MakeOneStoneChain(x, y);
+  const ChainNum b = chain_set.MakeOneStoneChain(NextX(NextX(x)), y);
+  chain_set.AddStoneToChainFast(NextX(x), y, a);
+  const ChainNum merged = chain_set.MergeChainsFast(NextX(x), y, a, b);
+  ChainSet copy;
+  copy.CopyFrom(chain_set);
+  fct_chk_eq_int(copy.size(), chain_set.size());
+  fct_chk_eq_int(copy.NewestVersion(a), merged);
+  fct_chk_eq_int(copy.NewestVersion(b), merged);
+  fct_chk_eq_int(copy.CountChains(), chain_set.CountChains());
+  fct_chk(copy.newest_stone_mask(a).Row(y) == 7u << x);
+  fct_chk(copy.MakeString(b) == chain_set.MakeString(a));
+FCT_QTEST_END();
+
 FCT_QTEST_BGN(ChainSet_sets_edges_correctly)
   ChainSet chain_set;
   for (int i = 1; i < PlayerPosition::kNumSpecialChains; ++i) {
@@ -391,7 +615,7 @@ FCT_QTEST_BGN(ChainSet_sets_edges_correctly)
   }
   Memento memento;
   for (YCoord y = kZeroY; y < kBoardHeight; y = NextY(y)) {
-    for (XCoord x = kZeroX; x < kThirtyTwoX; x = NextX(x)) {
+    for (XCoord x = kZeroX; x < kCellsInRow; x = NextX(x)) {
       if (!LiesOnBoard(x, y))
         continue;
       memento.RememberSize(&chain_set);
@@ -418,7 +642,7 @@ FCT_QTEST_BGN(ChainSet_sets_corners_correctly)
   }
   Memento memento;
   for (YCoord y = kZeroY; y < kBoardHeight; y = NextY(y)) {
-    for (XCoord x = kZeroX; x < kThirtyTwoX; x = NextX(x)) {
+    for (XCoord x = kZeroX; x < kCellsInRow; x = NextX(x)) {
       if (!LiesOnBoard(x, y))
         continue;
       memento.RememberSize(&chain_set);
@@ -645,6 +869,92 @@ FCT_QTEST_BGN(PlayerPosition_MoveWouldCloseForkBridgeOrRing_sees_filled_rings)
       true);
 FCT_QTEST_END();
 
+FCT_QTEST_BGN(PositionEvaluation_frame_kernels_match_combinations)
+  Position position;
+  position.InitToStartPosition();
+  const char* const kMoves[] = {
+    "e5", "f6", "d4", "g7", "c3", "h8", "e9", "j5", "b2", "f10",
+  };
+  for (size_t i = 0; i < ARRAYSIZE(kMoves); ++i) {
+    position.MakePermanentMove(
+        (i % 2 == 0) ? kWhite : kBlack, FromClassicalString(kMoves[i]));
+  }
+  const PlayerPosition& pp = position.player_position(kWhite);
+  const PlayerPosition& op = position.player_position(kBlack);
+  PositionEvaluation expected;
+  PositionEvaluation actual;
+  PositionEvaluation tmp;
+  BfsResult from_corner[6];
+  for (int i = 0; i < 6; ++i) {
+    pp.ComputeTwoDistance(Position::GetCornerChain(i), op, &from_corner[i]);
+  }
+  expected.SetAllMovesTo(BfsResult::kMaxDistance);
+  for (int i = 0; i < 6; ++i) {
+    for (int j = i + 1; j < 6; ++j) {
+      tmp.SetToCombination(
+          from_corner[i], from_corner[j],
+          Position::GetCornerChain(i), Position::GetCornerChain(j));
+      expected.SetToMinimum(expected, tmp);
+    }
+  }
+  actual.SetAllMovesTo(BfsResult::kMaxDistance);
+  actual.SetToMinimumWithBridgeFrames(from_corner);
+  for (MoveIndex m = kZerothMove; m <= kNumMovesOnBoard; m = NextMove(m)) {
+    fct_chk_eq_int(actual.get(m), expected.get(m));
+  }
+
+  BfsResult from_edge[6];
+  for (int i = 0; i < 6; ++i) {
+    pp.ComputeTwoDistance(Position::GetEdgeChain(i), op, &from_edge[i]);
+  }
+  const Chain* chain =
+      pp.NthChain(pp.NewestChainForCell(FromClassicalString("e5")));
+  BfsResult from_chain;
+  pp.ComputeTwoDistance(chain, op, &from_chain);
+  PositionEvaluation from_outside[6];
+  for (int j = 0; j < 6; ++j) {
+    from_outside[j].SetToCombination(
+        from_chain, from_edge[j], chain, Position::GetEdgeChain(j));
+  }
+  expected.SetAllMovesTo(BfsResult::kMaxDistance);
+  for (int k = 0; k < 3; ++k) {
+    const int* p = kForkPartitions[k];
+    PositionEvaluation sum;
+    sum.SetAllMovesTo(0);
+    for (int j = 0; j < 6; j += 2) {
+      tmp.SetToMinimum(from_outside[p[j]], from_outside[p[j + 1]]);
+      sum.SetToSum(sum, tmp);
+    }
+    expected.SetToMinimum(expected, sum);
+  }
+  actual.SetAllMovesTo(BfsResult::kMaxDistance);
+  actual.SetToMinimumWithForkFrames(from_chain, chain, from_edge);
+  for (MoveIndex m = kZerothMove; m <= kNumMovesOnBoard; m = NextMove(m)) {
+    fct_chk_eq_int(actual.get(m), expected.get(m));
+  }
+
+  // The bound used to prune fork frames never exceeds them.
+  BfsResult one_distance[6];
+  pp.ComputeOneDistancesFromEdges(
+      op, BfsResult::kMaxDistance - 1, one_distance);
+  BfsResult cut_one_distance[6];
+  pp.ComputeOneDistancesFromEdges(op, 2, cut_one_distance);
+  int bound[6];
+  for (int j = 0; j < 6; ++j) {
+    for (MoveIndex m = kZerothMove; m < kNumMovesOnBoard; m = NextMove(m)) {
+      const Cell cell = position.MoveIndexToCell(m);
+      fct_chk(one_distance[j].get(cell) <= from_edge[j].get(cell));
+      fct_chk_eq_int(cut_one_distance[j].get(cell),
+                     std::min(one_distance[j].get(cell), 3));
+    }
+    bound[j] = std::max(one_distance[j].GetTwoDistance(chain) - 1, 0);
+  }
+  const int shortest_bound = ShortestForkFrame(bound);
+  for (MoveIndex m = kZerothMove; m <= kNumMovesOnBoard; m = NextMove(m)) {
+    fct_chk(shortest_bound <= actual.get(m));
+  }
+FCT_QTEST_END();
+
 FCT_QTEST_BGN(Position_kNeighbors_are_initialized_correctly)
   for (Cell cell = kZerothCell; cell < kNumCellsWithSentinels;
        cell = NextCell(cell)) {
@@ -666,6 +976,53 @@ FCT_QTEST_BGN(Position_kNeighbors_are_initialized_correctly)
   }
 FCT_QTEST_END();
 
+FCT_QTEST_BGN(Position_kZobristHash_is_the_same_after_reinitialization)
+  std::vector<Hash> hashes;
+  for (MoveIndex move = kZerothMove; move < kNumMovesOnBoard;
+       move = NextMove(move)) {
+    hashes.push_back(Position::ModifyZobristHash(0, kWhite, move));
+    hashes.push_back(Position::ModifyZobristHash(0, kBlack, move));
+  }
+  Position::InitStaticFields();
+  int num_changed = 0;
+  for (MoveIndex move = kZerothMove; move < kNumMovesOnBoard;
+       move = NextMove(move)) {
+    num_changed += (Position::ModifyZobristHash(0, kWhite, move) !=
+                    hashes[2 * move]);
+    num_changed += (Position::ModifyZobristHash(0, kBlack, move) !=
+                    hashes[2 * move + 1]);
+  }
+  fct_chk_eq_int(num_changed, 0);
+  std::sort(hashes.begin(), hashes.end());
+  fct_chk(std::adjacent_find(hashes.begin(), hashes.end()) == hashes.end());
+FCT_QTEST_END();
+
+FCT_QTEST_BGN(Position_orders_available_moves_independently)
+  Position position;
+  position.InitToStartPosition();
+  const Cell a1 = FromClassicalString("a1");
+  const Cell d4 = FromClassicalString("d4");
+  position.MakePermanentMove(kWhite, a1);
+  position.MakePermanentMove(kBlack, d4);
+  Position other;
+  other.InitToStartPosition();
+  fct_chk_eq_int(other.NumAvailableMoves(), kNumMovesOnBoard);
+  for (int n = 0; n < kNumMovesOnBoard; ++n) {
+    fct_chk_eq_int(other.NthAvailableCell(n),
+                   Position::MoveIndexToCell(static_cast<MoveIndex>(n)));
+  }
+  fct_chk_eq_int(position.NumAvailableMoves(), kNumMovesOnBoard - 2);
+  fct_chk_eq_int(position.NthAvailableCell(kNumMovesOnBoard - 1), a1);
+  fct_chk_eq_int(position.NthAvailableCell(kNumMovesOnBoard - 2), d4);
+  for (int n = 0; n < position.NumAvailableMoves(); ++n) {
+    fct_chk(position.CellIsEmpty(position.NthAvailableCell(n)));
+  }
+  Position copy;
+  copy.CopyFrom(position);
+  fct_chk_eq_int(copy.NumAvailableMoves(), kNumMovesOnBoard - 2);
+  fct_chk_eq_int(copy.NthAvailableCell(kNumMovesOnBoard - 2), d4);
+FCT_QTEST_END();
+
 FCT_QTEST_BGN(Position_moves_are_remembered_correctly)
   Position position;
   position.InitToStartPosition();
@@ -818,7 +1175,7 @@ FCT_QTEST_END();
 
 FCT_QTEST_BGN(Position_GetBoardBitmask_gives_correct_results)
   for (YCoord y = kZeroY; y < kBoardHeight; y = NextY(y)) {
-    for (XCoord x = kZeroX; x < kThirtyTwoX; x = NextX(x)) {
+    for (XCoord x = kZeroX; x < kCellsInRow; x = NextX(x)) {
       fct_xchk(
           ((Position::GetBoardBitmask().Row(y) >> x) & 1) == LiesOnBoard(x, y),
           "(Position::GetBoardBitmask().Row(%d) >> %d) & 1 returns %d "
@@ -828,13 +1185,37 @@ FCT_QTEST_BGN(Position_GetBoardBitmask_gives_correct_results)
   }
 FCT_QTEST_END();
 
+FCT_QTEST_BGN(BoardBitmask_FillWithMaskOrTwiceAdjacent_counts_neighbors)
+  for (int modulus = 2; modulus <= 7; ++modulus) {
+    BoardBitmask mask;
+    mask.ZeroBits();
+    for (YCoord y = kZeroY; y < kBoardHeight; y = NextY(y)) {
+      for (XCoord x = kZeroX; x < kCellsInRow; x = NextX(x)) {
+        if (LiesOnBoard(x, y) && (3 * x + 5 * y) % modulus == 0)
+          mask.set(x, y);
+      }
+    }
+    BoardBitmask result;
+    result.FillWithMaskOrTwiceAdjacent(mask);
+    for (YCoord y = kGapAround; y < kPastRows; y = NextY(y)) {
+      for (XCoord x = kZeroX; x < kCellsInRow; x = NextX(x)) {
+        const bool expected = LiesOnBoard(x, y) &&
+            (mask.get(x, y) || CountSetBits(mask.Get6Neighbors(x, y)) >= 2);
+        fct_xchk(result.get(x, y) == expected,
+                 "cell %d, %d of modulus %d is %d instead of %d",
+                 x, y, modulus, result.get(x, y), expected);
+      }
+    }
+  }
+FCT_QTEST_END();
+
 FCT_QTEST_BGN(Position_Get18Neighbors_returns_correct_results)
   Position position;
   position.InitToStartPosition();
   position.MakeMoveFast(kWhite, FromClassicalString("d4"));
   position.MakeMoveFast(kBlack, FromClassicalString("e4"));
   for (YCoord y = kZeroY; y < kBoardHeight; y = NextY(y)) {
-    for (XCoord x = kZeroX; x < kThirtyTwoX; x = NextX(x)) {
+    for (XCoord x = kZeroX; x < kCellsInRow; x = NextX(x)) {
       if (!LiesOnBoard(x, y))
         continue;
       const Cell cell = XYToCell(x, y);
@@ -847,6 +1228,385 @@ FCT_QTEST_BGN(Position_Get18Neighbors_returns_correct_results)
   }
 FCT_QTEST_END();
 
+FCT_QTEST_BGN(Position_Get18Neighbors_follows_moves_and_undoing)
+  // Plays pseudorandom games and compares the neighborhoods of all cells
+  // with SlowNeighbors() after every move and after undoing the game.
+  unsigned seed = 1;
+  int num_mismatches = 0;
+  for (int game = 0; game < 20; ++game) {
+    Position position;
+    position.InitToStartPosition();
+    Memento memento;
+    WinningCondition result = kNoWinningCondition;
+    for (int i = 0; result == kNoWinningCondition && i < kNumMovesOnBoard;
+         ++i) {
+      const Cell cell = NextRandomEmptyCell(position, &seed);
+      result = position.MakeMoveReversibly(
+          static_cast<Player>(i & 1), cell, &memento);
+      num_mismatches += CountNeighborhoodMismatches(position);
+    }
+    memento.UndoAll();
+    num_mismatches += CountNeighborhoodMismatches(position);
+  }
+  fct_chk_eq_int(num_mismatches, 0);
+FCT_QTEST_END();
+
+FCT_QTEST_BGN(Position_CellIsDeadForPlayer_gives_correct_results)
+  static const struct {
+    const char* neighbors;
+    bool dead_for_white;
+    bool dead_for_black;
+  } test_data[] = {
+    { "wwbbbb", true, false },
+    { "wbwbbb", false, false },
+    { "wbbwbb", false, false },
+    { "wwwbbb", false, false },
+    { "bbbbbb", true, true },
+    { "wbbbb.", false, false },
+    { "wbwbwb", false, false },
+  };
+  Position position;
+  position.InitToStartPosition();
+  const Cell d4 = FromClassicalString("d4");
+  for (int i = 0; i < ARRAYSIZE(test_data); ++i) {
+    Memento memento;
+    for (int j = 0; j < 6; ++j) {
+      const char c = test_data[i].neighbors[j];
+      if (c != '.') {
+        position.MakeMoveReversibly(
+            c == 'w' ? kWhite : kBlack, NthNeighbor(d4, j), &memento);
+      }
+    }
+    fct_xchk(position.CellIsDeadForPlayer(kWhite, d4) ==
+             test_data[i].dead_for_white,
+             "CellIsDeadForPlayer(kWhite, d4) returns %d for %s",
+             position.CellIsDeadForPlayer(kWhite, d4),
+             test_data[i].neighbors);
+    fct_xchk(position.CellIsDeadForPlayer(kBlack, d4) ==
+             test_data[i].dead_for_black,
+             "CellIsDeadForPlayer(kBlack, d4) returns %d for %s",
+             position.CellIsDeadForPlayer(kBlack, d4),
+             test_data[i].neighbors);
+    memento.UndoAll();
+  }
+  // A stone in the corner would connect black's chain to the corner.
+  const Cell a1 = FromClassicalString("a1");
+  Memento memento;
+  for (int j = 0; j < 6; ++j) {
+    const Cell neighbor = NthNeighbor(a1, j);
+    if (LiesOnBoard(CellToX(neighbor), CellToY(neighbor)))
+      position.MakeMoveReversibly(kBlack, neighbor, &memento);
+  }
+  fct_chk(position.CellIsDeadForPlayer(kWhite, a1));
+  fct_chk(!position.CellIsDeadForPlayer(kBlack, a1));
+  memento.UndoAll();
+FCT_QTEST_END();
+
+FCT_QTEST_BGN(Position_CopyFrom_drops_superseded_chains)
+  Position position;
+  position.InitToStartPosition();
+  const Cell d4 = FromClassicalString("d4");
+  static const int kOrder[] = { 0, 2, 4, 1, 3 };
+  for (int i = 0; i < ARRAYSIZE(kOrder); ++i) {
+    position.MakePermanentMove(kWhite, NthNeighbor(d4, kOrder[i]));
+  }
+  Position copy;
+  copy.CopyFrom(position);
+  const PlayerPosition& original = position.player_position(kWhite);
+  const PlayerPosition& compacted = copy.player_position(kWhite);
+  fct_chk_eq_int(compacted.CountChains(), original.CountChains());
+  for (int j = 0; j < 5; ++j) {
+    const Cell cell = NthNeighbor(d4, j);
+    fct_chk_eq_int(compacted.chain_for_cell(cell),
+                   PlayerPosition::kNumSpecialChains);
+    fct_chk(MaskPrinter(compacted.ChainMaskForCell(cell)).MakeString() ==
+            MaskPrinter(original.ChainMaskForCell(cell)).MakeString());
+  }
+  fct_chk_eq_int(compacted.ring_frame_count(), original.ring_frame_count());
+  Memento memento;
+  const Cell last = NthNeighbor(d4, 5);
+  const int copy_result = copy.MakeMoveReversibly(kWhite, last, &memento);
+  const int result = position.MakeMoveReversibly(kWhite, last, &memento);
+  fct_chk(result != 0);
+  fct_chk_eq_int(copy_result, result);
+  memento.UndoAll();
+FCT_QTEST_END();
+
+FCT_QTEST_BGN(PlayerPosition_CountTwoBridges_matches_two_bridge_mask)
+  // Plays pseudorandom games and recounts two-bridges after every move.
+  unsigned seed = 1;
+  int num_mismatches = 0;
+  for (int game = 0; game < 50; ++game) {
+    Position position;
+    position.InitToStartPosition();
+    Memento memento;
+    WinningCondition result = kNoWinningCondition;
+    for (int i = 0; result == kNoWinningCondition && i < kNumMovesOnBoard;
+         ++i) {
+      const Cell cell = NextRandomEmptyCell(position, &seed);
+      result = position.MakeMoveReversibly(
+          static_cast<Player>(i & 1), cell, &memento);
+      for (int p = 0; p < 2; ++p) {
+        const PlayerPosition& pp =
+            position.player_position(static_cast<Player>(p));
+        BoardCounter counter;
+        pp.CountTwoBridges(
+            position.player_position(static_cast<Player>(1 - p)), &counter);
+        for (Cell c = kZerothCell; c < kNumCellsWithSentinels;
+             c = NextCell(c)) {
+          num_mismatches += (counter.get(c) != pp.two_bridge_mask().get(c));
+        }
+      }
+    }
+    memento.UndoAll();
+  }
+  fct_chk_eq_int(num_mismatches, 0);
+FCT_QTEST_END();
+
+FCT_QTEST_BGN(PlayerPosition_winning_cells_match_winning_moves)
+  // Plays pseudorandom games and tries every empty cell after every move.
+  unsigned seed = 1;
+  int num_mismatches = 0;
+  for (int game = 0; game < 20; ++game) {
+    Position position;
+    position.InitToStartPosition();
+    Memento memento;
+    WinningCondition result = kNoWinningCondition;
+    for (int i = 0; result == kNoWinningCondition && i < kNumMovesOnBoard;
+         ++i) {
+      const Cell cell = NextRandomEmptyCell(position, &seed);
+      result = position.MakeMoveReversibly(
+          static_cast<Player>(i & 1), cell, &memento);
+      if (result != kNoWinningCondition)
+        break;
+      for (int p = 0; p < 2; ++p) {
+        const Player player = static_cast<Player>(p);
+        for (int j = 0; j < kNumMovesOnBoard; ++j) {
+          const Cell c = position.NthAvailableCell(j);
+          bool wins = false;
+          if (position.CellIsEmpty(c)) {
+            Memento probe;
+            wins = (position.MakeMoveReversibly(player, c, &probe) !=
+                    kNoWinningCondition);
+            probe.UndoAll();
+          }
+          num_mismatches +=
+              (wins != position.player_position(player).winning_cells().get(
+                  CellToX(c), CellToY(c)));
+        }
+      }
+    }
+    memento.UndoAll();
+    for (int p = 0; p < 2; ++p) {
+      num_mismatches += !position.player_position(
+          static_cast<Player>(p)).winning_cells().IsZero();
+    }
+  }
+  fct_chk_eq_int(num_mismatches, 0);
+FCT_QTEST_END();
+
+FCT_QTEST_BGN(CompactPosition_finds_the_wins_of_Position)
+  // Plays pseudorandom games until a win and compares the outcomes.
+  unsigned seed = 1;
+  int num_wins[3] = { 0, 0, 0 };
+  for (int game = 0; game < 200; ++game) {
+    Position position;
+    position.InitToStartPosition();
+    CompactPosition compact_position;
+    compact_position.InitFromPosition(position);
+    Memento memento;
+    WinningCondition expected = kNoWinningCondition;
+    WinningCondition actual = kNoWinningCondition;
+    for (int i = 0; expected == kNoWinningCondition && i < kNumMovesOnBoard;
+         ++i) {
+      const Cell cell = NextRandomEmptyCell(position, &seed);
+      const Player player = static_cast<Player>(i & 1);
+      expected = position.MakeMoveReversibly(player, cell, &memento);
+      actual = compact_position.MakeMove(player, cell);
+      fct_xchk(((expected & (kRing | kBenzeneRing)) != 0) ==
+               ((actual & kRing) != 0) &&
+               (expected & (kBridge | kFork)) == (actual & (kBridge | kFork)),
+               "game %d, move %d: %d instead of %d", game, i, actual, expected);
+    }
+    num_wins[0] += ((actual & kRing) != 0);
+    num_wins[1] += ((actual & kBridge) != 0);
+    num_wins[2] += ((actual & kFork) != 0);
+    CompactPosition copy;
+    copy.InitFromPosition(position);
+    for (int p = 0; p < 2; ++p) {
+      const Player player = static_cast<Player>(p);
+      fct_chk(memcmp(&copy.stone_mask(player),
+                     &position.player_position(player).stone_mask(),
+                     sizeof(BoardBitmask)) == 0);
+    }
+    memento.UndoAll();
+  }
+  // All kinds of wins have been checked.
+  fct_chk(num_wins[0] > 0 && num_wins[1] > 0 && num_wins[2] > 0);
+FCT_QTEST_END();
+
+FCT_QTEST_BGN(VirtualConnections_prove_frames_through_two_bridges)
+  Position position;
+  position.InitToStartPosition();
+  Memento memento;
+  // The chain touches two edges and reaches k3 through j2 or j3,
+  // and k3 reaches the third edge through k2 or l3.
+  PlayCells(kWhite, "a2 b2 b1 c2 d2 e2 f2 g2 h2 i2 k3", &position, &memento);
+  PlayCells(kBlack, "j10 j11", &position, &memento);
+  const PlayerPosition& white = position.player_position(kWhite);
+  const PlayerPosition& black = position.player_position(kBlack);
+  VirtualConnections virtual_connections;
+  fct_chk(virtual_connections.FindFrame(white, black));
+  fct_chk_eq_int(virtual_connections.moves(), 2);
+  fct_chk_eq_int(virtual_connections.moves_if_intruded(), 2);
+  fct_chk(MaskHoldsCells(virtual_connections.carrier(), "j2 j3 k2 l3"));
+  fct_chk(!virtual_connections.FindFrame(black, white));
+  // After an intrusion the connection is only a semi-connection.
+  Memento intrusion;
+  PlayCells(kBlack, "j3", &position, &intrusion);
+  fct_chk(!virtual_connections.FindFrame(white, black));
+  intrusion.UndoAll();
+  PlayCells(kBlack, "l3", &position, &intrusion);
+  fct_chk(!virtual_connections.FindFrame(white, black));
+  intrusion.UndoAll();
+  memento.UndoAll();
+FCT_QTEST_END();
+
+FCT_QTEST_BGN(VirtualConnections_count_moves_of_wide_semi_connections)
+  Position position;
+  position.InitToStartPosition();
+  Memento memento;
+  // The chain reaches j3 through i2 and j2 or i3 and k3 or j2 and k3,
+  // j3 reaches k4 through k3 or l4, and k4 the edge through l3 or m4.
+  PlayCells(kWhite, "a2 b2 b1 c2 d2 e2 f2 g2 h2 j3 k4", &position, &memento);
+  PlayCells(kBlack, "j10 j11", &position, &memento);
+  VirtualConnections virtual_connections;
+  fct_chk(virtual_connections.FindFrame(
+      position.player_position(kWhite), position.player_position(kBlack)));
+  fct_chk_eq_int(virtual_connections.moves(), 3);
+  fct_chk_eq_int(virtual_connections.moves_if_intruded(), 3);
+  fct_chk(MaskHoldsCells(
+      virtual_connections.carrier(), "i2 j2 k2 i3 k3 l3 l4 m4"));
+  memento.UndoAll();
+FCT_QTEST_END();
+
+FCT_QTEST_BGN(VirtualConnections_frames_survive_intrusions)
+  // Plays pseudorandom games and fills the carrier of every frame found,
+  // first undisturbed and then after each intrusion into it.
+  unsigned seed = 1;
+  int num_frames = 0;
+  int num_failures = 0;
+  for (int game = 0; game < 100; ++game) {
+    Position position;
+    position.InitToStartPosition();
+    Memento memento;
+    for (int i = 0; i < kNumMovesOnBoard; ++i) {
+      const Cell cell = NextRandomEmptyCell(position, &seed);
+      const Player player = static_cast<Player>(i & 1);
+      const Player opponent = Opponent(player);
+      if (position.MakeMoveReversibly(player, cell, &memento) !=
+          kNoWinningCondition) {
+        break;
+      }
+      VirtualConnections virtual_connections;
+      if (!virtual_connections.FindFrame(
+              position.player_position(player),
+              position.player_position(opponent))) {
+        continue;
+      }
+      ++num_frames;
+      BoardBitmask carrier;
+      carrier.CopyFrom(virtual_connections.carrier());
+      Memento fill;
+      num_failures += !FillMask(player, carrier, kZerothCell, &position, &fill);
+      fill.UndoAll();
+      for (int j = 0; j < kNumMovesOnBoard; ++j) {
+        const Cell intrusion = position.NthAvailableCell(j);
+        if (!carrier.get(CellToX(intrusion), CellToY(intrusion)))
+          continue;
+        // A winning intrusion is the race that the frame does not cover.
+        if (position.MakeMoveReversibly(opponent, intrusion, &fill) ==
+            kNoWinningCondition) {
+          num_failures +=
+              !FillMask(player, carrier, intrusion, &position, &fill);
+        }
+        fill.UndoAll();
+      }
+    }
+    memento.UndoAll();
+  }
+  fct_chk(num_frames > 0);
+  fct_chk_eq_int(num_failures, 0);
+FCT_QTEST_END();
+
+FCT_QTEST_BGN(PlayerPosition_BoundMovesToWin_bounds_forks_and_bridges)
+  Position position;
+  position.InitToStartPosition();
+  Memento memento;
+  PlayCells(kBlack, "j10", &position, &memento);
+  const PlayerPosition& white = position.player_position(kWhite);
+  const PlayerPosition& black = position.player_position(kBlack);
+  Memento stones;
+  PlayCells(kWhite, "e5", &position, &stones);
+  fct_chk_eq_int(white.BoundMovesToWin(black, 3), 4);
+  stones.UndoAll();
+  // A stone on the left edge makes a fork.
+  PlayCells(kWhite, "b1 b2 b3 b4 b5 b6 b7 b8 b9 b10 b11", &position, &stones);
+  fct_chk_eq_int(white.BoundMovesToWin(black, 9), 1);
+  stones.UndoAll();
+  // Forks and bridges need three stones.
+  PlayCells(kWhite, "b1 b2 b3 b4 b5 b6 b7 b8 b9", &position, &stones);
+  const int bound = white.BoundMovesToWin(black, 9);
+  fct_chk(bound >= 2 && bound <= 3);
+  fct_chk_eq_int(white.BoundMovesToWin(black, 1), 2);
+  stones.UndoAll();
+  // A ring that needs one stone.
+  PlayCells(kWhite, "e5 f6 g6 g5 f4", &position, &stones);
+  fct_chk_eq_int(white.BoundMovesToWin(black, 9), 1);
+  stones.UndoAll();
+  memento.UndoAll();
+FCT_QTEST_END();
+
+FCT_QTEST_BGN(CountMovesToWin_keeps_proofs_of_frames_at_other_depths)
+  Position position;
+  position.InitToStartPosition();
+  Memento memento;
+  // Black c3 leaves white no ring in three moves, so the win goes through
+  // the frame and the second iteration revisits its proven nodes.
+  PlayCells(kWhite, "a2 b2 b1 c2 d2 e2 f2 g2 h2 j3 k4", &position, &memento);
+  PlayCells(kBlack, "c3 j11", &position, &memento);
+  VirtualConnections virtual_connections;
+  fct_chk(virtual_connections.FindFrame(
+      position.player_position(kWhite), position.player_position(kBlack)));
+  for (int max_depth = 2; max_depth <= 3; ++max_depth) {
+    Cell move = kZerothCell;
+    fct_chk_eq_int(CountMovesToWin(position, kWhite, max_depth, &move), 3);
+    fct_xchk(move != kZerothCell &&
+             virtual_connections.carrier().get(CellToX(move), CellToY(move)),
+             "max_depth %d: %s", max_depth, ToString(move).c_str());
+  }
+  memento.UndoAll();
+FCT_QTEST_END();
+
+FCT_QTEST_BGN(CountMovesToWin_lets_the_defender_block_single_threats)
+  Position position;
+  position.InitToStartPosition();
+  Memento memento;
+  // After f4, white threatens a ring only at e4. Black learns that cell
+  // from the proof of the win in one, so f4 is not a win in two.
+  PlayCells(kWhite, "e5 f6 g6 g5", &position, &memento);
+  PlayCells(kBlack, "j10 j11 k12", &position, &memento);
+  Cell move = kZerothCell;
+  fct_chk_eq_int(CountMovesToWin(position, kWhite, 2, &move), 0);
+  memento.UndoAll();
+  // Two threats at once cannot be blocked.
+  PlayCells(kWhite, "a1 b1 c1 d1 e1 f1 g1 h1 j2", &position, &memento);
+  PlayCells(kBlack, "j10 j11 k12", &position, &memento);
+  fct_chk_eq_int(CountMovesToWin(position, kWhite, 3, &move), 2);
+  fct_xchk(move == FromClassicalString("j1"), "%s", ToString(move).c_str());
+  memento.UndoAll();
+FCT_QTEST_END();
+
 FCT_QTEST_BGN(Position_ParseString_gives_correct_results)
   Position position;
   position.InitToStartPosition();
@@ -873,4 +1633,52 @@ FCT_QTEST_BGN(Position_ParseString_gives_correct_results)
   g_use_lg_coordinates = remember_coordinate_system;
 FCT_QTEST_END();
 
+FCT_QTEST_BGN(DescribesBoard_tells_boards_from_lists_of_moves)
+  Position position;
+  position.InitToStartPosition();
+  position.MakeMoveFast(kWhite, FromClassicalString("d7"));
+  position.MakeMoveFast(kBlack, FromClassicalString("j3"));
+  fct_chk(DescribesBoard(position.MakeString()));
+  fct_chk(DescribesBoard("x o\nx"));
+  // Columns x and o exist on boards of side 13 and more.
+  fct_chk(!DescribesBoard("x12 o3 a1"));
+  fct_chk(!DescribesBoard(" d7\tj3\n"));
+  fct_chk(!DescribesBoard(""));
+FCT_QTEST_END();
+
+FCT_QTEST_BGN(EvaluateBatch_writes_lines_in_order_on_any_number_of_threads)
+  bool remember_coordinate_system = g_use_lg_coordinates;
+  g_use_lg_coordinates = false;
+  Position position;
+  position.InitToStartPosition();
+  Memento memento;
+  PlayCells(kWhite, "d7 e5", &position, &memento);
+  PlayCells(kBlack, "j3", &position, &memento);
+  std::string text =
+      "d7 j3 e5\n\n" + position.MakeString() + "\n\n\na1 a1\n\nz99\n";
+  memento.UndoAll();
+  const char* const kGames[] = {
+    "j10 k10 j9", "a1\nb2 c3", "R9 q8", "e5 f6 g6 g5 j10 j11 k12",
+    "a1 b1 c1 d1 e1 f1 g1 h1 j2", "j10", "a2 b2 b1 c2 d2 e2 f2 g2 h2",
+  };
+  for (int i = 0; i < ARRAYSIZE(kGames); ++i) {
+    text += "\n";
+    text += kGames[i];
+    text += "\n";
+  }
+  const std::vector<std::string> lines = EvaluateBatchOfText(text, 1);
+  fct_chk_eq_int(lines.size(), 4 + ARRAYSIZE(kGames));
+  for (size_t i = 0; i < lines.size(); ++i) {
+    fct_xchk(atoi(lines[i].c_str()) == static_cast<int>(i), "%s",
+             lines[i].c_str());
+  }
+  // The same position as a list of moves and as a board.
+  fct_chk(lines.size() >= 2 &&
+          lines[0].substr(1) == lines[1].substr(1) && lines[0] != "0 ?\n");
+  // An occupied cell and an invalid move.
+  fct_chk(lines.size() >= 4 && lines[2] == "2 ?\n" && lines[3] == "3 ?\n");
+  fct_chk(EvaluateBatchOfText(text, 4) == lines);
+  g_use_lg_coordinates = remember_coordinate_system;
+FCT_QTEST_END();
+
 FCT_END();